@@ -122,13 +122,12 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
-
-static char *mpc_err_char_unescape(char c) {
+static char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
   char_unescape_buffer[2] = '\'';
+  char_unescape_buffer[3] = '\0';
   
   switch (c) {
     
@@ -150,6 +149,7 @@ static char *mpc_err_char_unescape(char c) {
 
 char *mpc_err_string(mpc_err_t *x) {
   
+  char unescaped[4];
   char *buffer = calloc(1, 1024);
   int max = 1023;
   int pos = 0; 
@@ -179,7 +179,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -280,10 +280,10 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The contents are scanned
+** through in place and their length is known
+** up front. The cursor can jump around at will
+** making backtracking easy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
@@ -291,15 +291,19 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
+** one. As we assume pipes cannot be seeked
+** everything read from the pipe goes into a
+** buffer, and reading at a position takes the
+** character from there.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. Anything behind
+** the oldest mark, or behind the cursor when
+** there are no marks, can never be read again,
+** so it is dropped whenever the buffer fills.
+** The buffer then only grows with the span of
+** input a backtrack may need.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -319,12 +323,17 @@ typedef struct {
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  int length;
   char *buffer;
+  int buffer_pos;
+  int buffer_num;
+  int buffer_slots;
   FILE *file;
   
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
@@ -342,13 +351,17 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
+  i->length = strlen(string);
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
 
@@ -368,11 +381,16 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -392,11 +410,16 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
   i->file = file;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -409,7 +432,11 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  /* Hand a character that was only peeked at back to the pipe */
+  if (i->type == MPC_INPUT_PIPE && i->buffer_pos + i->buffer_num == i->state.pos + 1) {
+    ungetc((unsigned char)i->buffer[i->buffer_num-1], i->file);
+  }
+  
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
   free(i->marks);
@@ -425,15 +452,14 @@ static void mpc_input_mark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_num + i->marks_num / 2;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -441,13 +467,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
   
 }
 
@@ -466,17 +485,46 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + i->buffer_num;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+  
+  int c, drop;
+  
+  if (mpc_input_buffer_in_range(i)) { return 1; }
+  
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
+  
+  if (i->buffer_num == i->buffer_slots) {
+    
+    drop = i->state.pos;
+    if (i->marks_num > 0 && i->marks[0].pos < drop) { drop = i->marks[0].pos; }
+    drop -= i->buffer_pos;
+    
+    if (drop > 0 && drop >= i->buffer_num / 2) {
+      memmove(i->buffer, i->buffer + drop, i->buffer_num - drop);
+      i->buffer_pos += drop;
+      i->buffer_num -= drop;
+    } else {
+      i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : 256;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+  }
+  
+  i->buffer[i->buffer_num++] = c;
+  return 1;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_fill(i)) { return 1; }
   return 0;
 }
 
@@ -488,18 +536,7 @@ static char mpc_input_getc(mpc_input_t *i) {
     
     case MPC_INPUT_STRING: return i->string[i->state.pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-    
+    case MPC_INPUT_PIPE: return mpc_input_buffer_fill(i) ? mpc_input_buffer_get(i) : c;
     default: return c;
   }
 }
@@ -518,24 +555,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
     
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
+    case MPC_INPUT_PIPE: return mpc_input_buffer_fill(i) ? mpc_input_buffer_get(i) : c;
     default: return c;
   }
   
@@ -546,16 +566,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: break;
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-      
+    case MPC_INPUT_PIPE: break;
   }
   
   return 0;
@@ -563,15 +574,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -626,25 +628,43 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+static mpc_state_t mpc_state_advance(mpc_state_t s, const char *x, int n) {
+  int j;
+  for (j = 0; j < n; j++) {
+    s.pos++;
+    s.col++;
+    if (x[j] == '\n') {
+      s.col = 0;
+      s.row++;
+    }
+  }
+  return s;
+}
+
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
-
-  mpc_input_mark(i);
-  while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
-      mpc_input_rewind(i);
-      return 0;
+  size_t n = strlen(c);
+  
+  if (i->type == MPC_INPUT_STRING && i->backtrack > 0) {
+    if ((size_t)(i->length - i->state.pos) < n
+    ||  memcmp(i->string + i->state.pos, c, n) != 0) { return 0; }
+    i->state = mpc_state_advance(i->state, c, n);
+    if (n > 0) { i->last = c[n-1]; }
+  } else {
+    mpc_input_mark(i);
+    while (*x) {
+      if (!mpc_input_char(i, *x, NULL)) {
+        mpc_input_rewind(i);
+        return 0;
+      }
+      x++;
     }
-    x++;
+    mpc_input_unmark(i);
   }
-  mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  *o = malloc(n + 1);
+  memcpy(*o, c, n + 1);
   return 1;
 }
 
@@ -684,7 +704,10 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_MEMO      = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -703,6 +726,20 @@ typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdat
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
+typedef struct {
+  char *re;
+  int soi;
+  int eoi;
+  int states_num;
+  short *trans;
+  char *accepts;
+  int *expected_num;
+  char ***expected;
+} mpc_dfa_t;
+
+typedef struct { mpc_dfa_t *x; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
+
 typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
@@ -719,6 +756,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -728,8 +767,264 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** DFA Type
+**
+** Regular expressions that can be matched
+** without backtracking are compiled by `mpc_re`
+** into a table with 256 transitions per state.
+** Matching is then a single loop over the input
+** which remembers the last accepting position.
+**
+** For every state the table also keeps the
+** messages that the combinators would have
+** reported when stopping there, so errors read
+** the same either way.
+*/
+
+static mpc_err_t *mpc_dfa_err(mpc_input_t *i, mpc_dfa_t *d, int s, mpc_state_t at, char next, int failed) {
+  
+  int j;
+  mpc_err_t *e = NULL;
+  
+  for (j = 0; j < d->expected_num[s]; j++) {
+    if (e == NULL) { e = mpc_err_new(i->filename, at, d->expected[s][j], next); }
+    else { mpc_err_add_expected(e, d->expected[s][j]); }
+  }
+  
+  if (!failed) { return e; }
+  
+  if (d->eoi && d->accepts[s]) {
+    if (e == NULL) { e = mpc_err_new(i->filename, at, "end of input", next); }
+    else if (!mpc_err_contains_expected(e, "end of input")) { mpc_err_add_expected(e, "end of input"); }
+  }
+  
+  return e ? e : mpc_err_fail(i->filename, at, "Incorrect Input");
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o, mpc_err_t **e) {
+  
+  const unsigned char *x;
+  int s = 0, n = 0, last = -1, t;
+  int slots = 16;
+  char c = '\0';
+  char *b;
+  
+  *e = NULL;
+  
+  if (d->soi && i->last != '\0') {
+    *e = mpc_err_new(i->filename, i->state, "start of input", mpc_input_peekc(i));
+    return 0;
+  }
+  
+  /* Strings are scanned in place */
+  
+  if (i->type == MPC_INPUT_STRING) {
+    
+    x = (const unsigned char*)i->string + i->state.pos;
+    
+    while (1) {
+      if (d->accepts[s] && (!d->eoi || x[n] == '\0')) { last = n; }
+      t = d->trans[s * 256 + x[n]];
+      if (t < 0) { break; }
+      s = t;
+      n++;
+    }
+    
+    *e = mpc_dfa_err(i, d, s, mpc_state_advance(i->state, (const char*)x, n), x[n], last < 0);
+    if (last < 0) { return 0; }
+    
+    *o = malloc(last + 1);
+    memcpy(*o, x, last);
+    (*o)[last] = '\0';
+    
+    if (last > 0) { i->last = x[last-1]; }
+    i->state = mpc_state_advance(i->state, (const char*)x, last);
+    return 1;
+  }
+  
+  /* Files and pipes go through the usual marks */
+  
+  b = malloc(slots);
+  mpc_input_mark(i);
+  
+  while (1) {
+    c = mpc_input_peekc(i);
+    if (d->accepts[s] && (!d->eoi || c == '\0')) { last = n; }
+    t = d->trans[s * 256 + (unsigned char)c];
+    if (t < 0 || !mpc_input_any(i, NULL)) { break; }
+    if (n + 1 >= slots) {
+      slots *= 2;
+      b = realloc(b, slots);
+    }
+    b[n++] = c;
+    s = t;
+  }
+  
+  *e = mpc_dfa_err(i, d, s, i->state, c, last < 0);
+  
+  if (last < 0) {
+    mpc_input_rewind(i);
+    free(b);
+    return 0;
+  }
+  
+  /* Go back to the last accept, keeping the mark until there */
+  if (last < n && i->backtrack > 0) {
+    i->state = i->marks[i->marks_num-1];
+    i->last  = i->lasts[i->marks_num-1];
+    if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+    for (t = 0; t < last; t++) { mpc_input_any(i, NULL); }
+  }
+  
+  mpc_input_unmark(i);
+  
+  b[last] = '\0';
+  *o = b;
+  return 1;
+}
+
+/*
+** Memo Type
+**
+** In packrat mode the result of every rule is
+** stored under the rule and the position it was
+** tried at. Trying the rule there again then
+** costs a copy of the result instead of another
+** parse, which keeps parse time linear however
+** much the grammar backtracks.
+**
+** The table belongs to a single parse. Once its
+** entries hold `MPC_PACKRAT_MAX` bytes it takes
+** no more, so a huge input degrades to plain
+** backtracking instead of running out of memory.
+*/
+
+#ifndef MPC_PACKRAT_MAX
+#define MPC_PACKRAT_MAX (64 * 1024 * 1024)
+#endif
+
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  int ok;
+  mpc_state_t end;
+  char last;
+  mpc_result_t r;
+} mpc_memo_entry_t;
+
+typedef struct {
+  int num;
+  int slots;
+  size_t size;
+  mpc_memo_entry_t *entries;
+} mpc_memo_t;
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a, size_t *size);
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x, size_t *size) {
+  
+  int i;
+  mpc_err_t *e = malloc(sizeof(mpc_err_t));
+  
+  e->state = x->state;
+  e->recieved = x->recieved;
+  e->filename = malloc(strlen(x->filename) + 1);
+  strcpy(e->filename, x->filename);
+  e->failure = NULL;
+  if (x->failure) {
+    e->failure = malloc(strlen(x->failure) + 1);
+    strcpy(e->failure, x->failure);
+  }
+  
+  e->expected_num = x->expected_num;
+  e->expected = malloc(sizeof(char*) * x->expected_num);
+  for (i = 0; i < x->expected_num; i++) {
+    e->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(e->expected[i], x->expected[i]);
+    if (size) { *size += strlen(x->expected[i]) + 1 + sizeof(char*); }
+  }
+  
+  if (size) { *size += sizeof(mpc_err_t) + strlen(x->filename) + 1; }
+  
+  return e;
+}
+
+static int mpc_memo_slot(mpc_memo_t *m, mpc_parser_t *p, int pos) {
+  unsigned long h = (unsigned long)(size_t)p * 31 + (unsigned long)pos * 2654435761UL;
+  int j = (int)(h & (m->slots - 1));
+  while (m->entries[j].p && (m->entries[j].p != p || m->entries[j].pos != pos)) {
+    j = (j + 1) & (m->slots - 1);
+  }
+  return j;
+}
+
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_t *m, mpc_parser_t *p, int pos) {
+  mpc_memo_entry_t *e;
+  if (m->num == 0) { return NULL; }
+  e = &m->entries[mpc_memo_slot(m, p, pos)];
+  return e->p ? e : NULL;
+}
+
+static void mpc_memo_add(mpc_memo_t *m, mpc_parser_t *p, int pos, int ok, mpc_result_t r, mpc_input_t *i) {
+  
+  int j, slots;
+  mpc_memo_entry_t *entries, *e;
+  
+  if (m->size > MPC_PACKRAT_MAX) { return; }
+  
+  if ((m->num + 1) * 2 > m->slots) {
+    
+    slots = m->slots;
+    entries = m->entries;
+    
+    m->slots = slots ? slots * 2 : 256;
+    m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+    for (j = 0; j < slots; j++) {
+      if (entries[j].p) { m->entries[mpc_memo_slot(m, entries[j].p, entries[j].pos)] = entries[j]; }
+    }
+    
+    m->size += (m->slots - slots) * sizeof(mpc_memo_entry_t);
+    free(entries);
+  }
+  
+  e = &m->entries[mpc_memo_slot(m, p, pos)];
+  if (e->p) { return; }
+  
+  e->p = p;
+  e->pos = pos;
+  e->ok = ok;
+  e->end = i->state;
+  e->last = i->last;
+  if (ok) { e->r.output = mpc_ast_copy(r.output, &m->size); }
+  else    { e->r.error = mpc_err_copy(r.error, &m->size); }
+  m->num++;
+}
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  int j;
+  for (j = 0; j < m->slots; j++) {
+    if (!m->entries[j].p) { continue; }
+    if (m->entries[j].ok) { mpc_ast_delete(m->entries[j].r.output); }
+    else { mpc_err_delete(m->entries[j].r.error); }
+  }
+  free(m->entries);
+}
+
+static void mpc_input_skip(mpc_input_t *i, mpc_state_t s, char last) {
+  i->state = s;
+  i->last = last;
+  if (i->type == MPC_INPUT_FILE) { fseek(i->file, s.pos, SEEK_SET); }
+}
+
 /*
 ** Stack Type
+**
+** The stacks grow as a parse needs them and never
+** shrink while it runs. They live in a parse
+** context, which can be kept between calls so
+** that later parses start out with the memory
+** the earlier ones grew.
 */
 
 typedef struct {
@@ -745,24 +1040,58 @@ typedef struct {
   int *returns;
   
   mpc_err_t *err;
+  mpc_memo_t memo;
   
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+struct mpc_context_t {
+  mpc_stack_t stack;
+  int marks_slots;
+  mpc_state_t *marks;
+  char *lasts;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
   
-  s->parsers_num = 0;
-  s->parsers_slots = 0;
-  s->parsers = NULL;
-  s->states = NULL;
+  c->stack.parsers_slots = 0;
+  c->stack.parsers = NULL;
+  c->stack.states = NULL;
+  
+  c->stack.results_slots = 0;
+  c->stack.results = NULL;
+  c->stack.returns = NULL;
+  
+  c->marks_slots = 0;
+  c->marks = NULL;
+  c->lasts = NULL;
   
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  free(c->stack.parsers);
+  free(c->stack.states);
+  free(c->stack.results);
+  free(c->stack.returns);
+  free(c->marks);
+  free(c->lasts);
+  free(c);
+}
+
+static mpc_stack_t *mpc_stack_new(mpc_context_t *c, const char *filename) {
+  mpc_stack_t *s = &c->stack;
+  
+  s->parsers_num = 0;
   s->results_num = 0;
-  s->results_slots = 0;
-  s->results = NULL;
-  s->returns = NULL;
   
   s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
   
+  s->memo.num = 0;
+  s->memo.slots = 0;
+  s->memo.size = 0;
+  s->memo.entries = NULL;
+  
   return s;
 }
 
@@ -784,11 +1113,7 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
     r->error = s->err;
   }
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  mpc_memo_clear(&s->memo);
   
   return success;
 }
@@ -807,14 +1132,6 @@ static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   }
 }
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
 static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
   s->parsers_num++;
   mpc_stack_parsers_reserve_more(s);
@@ -826,7 +1143,6 @@ static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
 static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
@@ -860,14 +1176,6 @@ static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   }
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
 static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
   s->results_num++;
   mpc_stack_results_reserve_more(s);
@@ -880,7 +1188,6 @@ static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
   *x = s->results[s->results_num-1];
   r = s->returns[s->results_num-1];
   s->results_num--;
-  mpc_stack_results_reserve_less(s);
   return r;
 }
 
@@ -962,17 +1269,25 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 #define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
 #define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_parse_input_with(mpc_context_t *c, mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_stack_t *stk = mpc_stack_new(c, i->filename);
   
   /* Variables */
   char *s;
+  int ok;
+  mpc_err_t *e;
+  mpc_memo_entry_t *m;
   mpc_result_t r;
 
+  /* Marks */
+  i->marks_slots = c->marks_slots;
+  i->marks = c->marks;
+  i->lasts = c->lasts;
+  
   /* Go! */
   mpc_stack_pushp(stk, init);
   
@@ -992,6 +1307,14 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
       case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
       
+      case MPC_TYPE_DFA:
+        if (mpc_input_dfa(i, p->data.dfa.x, &s, &e)) {
+          if (e) { mpc_stack_err(stk, e); }
+          MPC_SUCCESS(s);
+        } else {
+          MPC_FAILURE(e);
+        }
+      
       /* Other parsers */
       
       case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
@@ -1049,6 +1372,22 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           continue;
         }
       
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          m = i->backtrack > 0 ? mpc_memo_find(&stk->memo, p, i->state.pos) : NULL;
+          if (m && m->ok) {
+            mpc_input_skip(i, m->end, m->last);
+            MPC_SUCCESS(mpc_ast_copy(m->r.output, NULL));
+          }
+          if (m) { MPC_FAILURE(mpc_err_copy(m->r.error, NULL)); }
+          MPC_CONTINUE(i->state.pos + 1, p->data.memo.x);
+        }
+        if (st >  0) {
+          ok = mpc_stack_popr(stk, &r);
+          if (i->backtrack > 0) { mpc_memo_add(&stk->memo, p, st-1, ok, r, i); }
+          if (ok) { MPC_SUCCESS(r.output); } else { MPC_FAILURE(r.error); }
+        }
+      
       /* Optional Parsers */
       
       /* TODO: Update Not Error Message */
@@ -1170,6 +1509,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
     }
   }
   
+  c->marks_slots = i->marks_slots;
+  c->marks = i->marks;
+  c->lasts = i->lasts;
+  i->marks = NULL;
+  i->lasts = NULL;
+  
   return mpc_stack_terminate(stk, final);
   
 }
@@ -1179,6 +1524,14 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 #undef MPC_FAILURE
 #undef MPC_PRIMATIVE
 
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  int x;
+  mpc_context_t *c = mpc_context_new();
+  x = mpc_parse_input_with(c, i, init, final);
+  mpc_context_delete(c);
+  return x;
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
@@ -1187,6 +1540,14 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_with(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input_with(c, i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1206,6 +1567,8 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
+  char *s = NULL;
+  long n;
   int res;
   
   if (f == NULL) {
@@ -1214,7 +1577,35 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  /*
+  ** Regular files are read whole and parsed as a
+  ** string, which saves a seek on every character.
+  ** Contents with a null byte in them are parsed
+  ** straight from the file, and anything that can't
+  ** seek is read as a pipe.
+  */
+  
+  if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) >= 0) {
+    rewind(f);
+    s = malloc(n + 1);
+    if (fread(s, 1, n, f) != (size_t)n || memchr(s, '\0', n)) {
+      free(s);
+      s = NULL;
+      rewind(f);
+    } else {
+      s[n] = '\0';
+    }
+  }
+  
+  if (s) {
+    res = mpc_parse(filename, s, p, r);
+    free(s);
+  } else if (fseek(f, 0, SEEK_CUR) != 0) {
+    res = mpc_parse_pipe(filename, f, p, r);
+  } else {
+    res = mpc_parse_file(filename, f, p, r);
+  }
+  
   fclose(f);
   return res;
 }
@@ -1224,6 +1615,7 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 */
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_dfa_delete(mpc_dfa_t *d);
 
 static void mpc_undefine_or(mpc_parser_t *p) {
   
@@ -1261,6 +1653,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       break;
     
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
     
@@ -1282,6 +1675,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    case MPC_TYPE_DFA: mpc_dfa_delete(p->data.dfa.x); break;
     
     default: break;
   }
@@ -2007,10 +2401,469 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regular Expression DFAs
+*/
+
+/*
+** The parser built above follows PEG rules.
+** Choices are ordered and repetition never
+** gives back what it matched. A DFA matches
+** the same strings as long as every step can
+** be decided by the next character alone.
+**
+** So the combinator tree is read back into
+** a small regex tree and its Glushkov automaton
+** is built, with one state per character class
+** plus the start. If no state has two ways to
+** go on the same character, the automaton is
+** already a DFA and replaces the tree.
+**
+** Everything else keeps the combinators. That
+** is counts, lookaheads like `\B`, anchors in
+** the middle, choices and repetitions of things
+** that can match nothing, and `+` over more
+** than a single character class.
+*/
+
+enum {
+  MPC_DFA_LEAF = 0,
+  MPC_DFA_SEQ  = 1,
+  MPC_DFA_ALT  = 2,
+  MPC_DFA_OPT  = 3,
+  MPC_DFA_STAR = 4,
+  MPC_DFA_PLUS = 5,
+  MPC_DFA_SOI  = 6,
+  MPC_DFA_EOI  = 7
+};
+
+#define MPC_DFA_LEAVES_MAX 255
+#define MPC_DFA_END -1
+
+typedef struct {
+  int num;
+  int *xs;
+} mpc_dfa_list_t;
+
+typedef struct {
+  int type;
+  int nullable;
+  int leaf;
+  int xs_num;
+  int *xs;
+} mpc_dfa_node_t;
+
+typedef struct {
+  int nodes_num;
+  mpc_dfa_node_t *nodes;
+  int leaves_num;
+  unsigned char (*sets)[256];
+  char **msgs;
+  mpc_dfa_list_t *follows;
+} mpc_dfa_builder_t;
+
+static void mpc_dfa_list_add(mpc_dfa_list_t *l, int x) {
+  l->num++;
+  l->xs = realloc(l->xs, sizeof(int) * l->num);
+  l->xs[l->num-1] = x;
+}
+
+static void mpc_dfa_list_cat(mpc_dfa_list_t *l, mpc_dfa_list_t *m) {
+  int j;
+  for (j = 0; j < m->num; j++) { mpc_dfa_list_add(l, m->xs[j]); }
+}
+
+static int mpc_dfa_set(mpc_parser_t *p, unsigned char *set) {
+  
+  int j, c;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_set(p->data.expect.x, set);
+    
+    case MPC_TYPE_ANY:
+      for (c = 1; c < 256; c++) { set[c] = 1; }
+      return 1;
+    
+    case MPC_TYPE_SINGLE:
+      if (p->data.single.x) { set[(unsigned char)p->data.single.x] = 1; }
+      return 1;
+    
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { set[c] = 1; }
+      }
+      return 1;
+    
+    case MPC_TYPE_ONEOF:
+      for (j = 0; p->data.string.x[j]; j++) { set[(unsigned char)p->data.string.x[j]] = 1; }
+      return 1;
+    
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (!strchr(p->data.string.x, c)) { set[c] = 1; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_set(p->data.or.xs[j], set)) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_dfa_node_new(mpc_dfa_builder_t *b, int type, int nullable) {
+  mpc_dfa_node_t *n;
+  b->nodes_num++;
+  b->nodes = realloc(b->nodes, sizeof(mpc_dfa_node_t) * b->nodes_num);
+  n = &b->nodes[b->nodes_num-1];
+  n->type = type;
+  n->nullable = nullable;
+  n->leaf = -1;
+  n->xs_num = 0;
+  n->xs = NULL;
+  return b->nodes_num-1;
+}
+
+static void mpc_dfa_node_add(mpc_dfa_builder_t *b, int n, int x) {
+  mpc_dfa_node_t *m = &b->nodes[n];
+  m->xs_num++;
+  m->xs = realloc(m->xs, sizeof(int) * m->xs_num);
+  m->xs[m->xs_num-1] = x;
+}
+
+static int mpc_dfa_is_anchor(mpc_parser_t *p, int(*f)(char,char)) {
+  return p->type == MPC_TYPE_EXPECT
+    && p->data.expect.x->type == MPC_TYPE_ANCHOR
+    && p->data.expect.x->data.anchor.f == f;
+}
+
+static int mpc_dfa_node(mpc_dfa_builder_t *b, mpc_parser_t *p) {
+  
+  int j, k, n, x;
+  unsigned char set[256];
+  
+  if (p->retained) { return -1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+      memset(set, 0, sizeof(set));
+      if (b->leaves_num == MPC_DFA_LEAVES_MAX || !mpc_dfa_set(p->data.expect.x, set)) { return -1; }
+      n = mpc_dfa_node_new(b, MPC_DFA_LEAF, 0);
+      b->nodes[n].leaf = b->leaves_num++;
+      b->sets = realloc(b->sets, sizeof(*b->sets) * b->leaves_num);
+      b->msgs = realloc(b->msgs, sizeof(char*) * b->leaves_num);
+      memcpy(b->sets[b->leaves_num-1], set, sizeof(set));
+      b->msgs[b->leaves_num-1] = p->data.expect.m;
+      return n;
+    
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return -1; }
+      return mpc_dfa_node_new(b, MPC_DFA_SEQ, 1);
+    
+    case MPC_TYPE_AND:
+      
+      if (p->data.and.f == mpcf_snd && p->data.and.n == 2
+      &&  p->data.and.xs[1]->type == MPC_TYPE_LIFT
+      &&  p->data.and.xs[1]->data.lift.lf == mpcf_ctor_str) {
+        if (mpc_dfa_is_anchor(p->data.and.xs[0], mpc_soi_anchor)) { return mpc_dfa_node_new(b, MPC_DFA_SOI, 1); }
+        if (mpc_dfa_is_anchor(p->data.and.xs[0], mpc_eoi_anchor)) { return mpc_dfa_node_new(b, MPC_DFA_EOI, 1); }
+      }
+      
+      if (p->data.and.f != mpcf_strfold) { return -1; }
+      
+      /* Nested sequences are flattened */
+      n = mpc_dfa_node_new(b, MPC_DFA_SEQ, 1);
+      for (j = 0; j < p->data.and.n; j++) {
+        x = mpc_dfa_node(b, p->data.and.xs[j]);
+        if (x == -1) { return -1; }
+        if (b->nodes[x].type == MPC_DFA_SEQ) {
+          for (k = 0; k < b->nodes[x].xs_num; k++) { mpc_dfa_node_add(b, n, b->nodes[x].xs[k]); }
+        } else {
+          mpc_dfa_node_add(b, n, x);
+        }
+        b->nodes[n].nullable = b->nodes[n].nullable && b->nodes[x].nullable;
+      }
+      return n;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return -1; }
+      n = mpc_dfa_node_new(b, MPC_DFA_ALT, 0);
+      for (j = 0; j < p->data.or.n; j++) {
+        x = mpc_dfa_node(b, p->data.or.xs[j]);
+        if (x == -1 || b->nodes[x].nullable) { return -1; }
+        mpc_dfa_node_add(b, n, x);
+      }
+      return n;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      
+      if (p->type == MPC_TYPE_MAYBE && p->data.not.lf != mpcf_ctor_str) { return -1; }
+      if (p->type != MPC_TYPE_MAYBE && p->data.repeat.f != mpcf_strfold) { return -1; }
+      
+      x = mpc_dfa_node(b, p->type == MPC_TYPE_MAYBE ? p->data.not.x : p->data.repeat.x);
+      if (x == -1 || b->nodes[x].nullable) { return -1; }
+      if (p->type == MPC_TYPE_MANY1 && b->nodes[x].type != MPC_DFA_LEAF) { return -1; }
+      
+      n = mpc_dfa_node_new(b,
+        p->type == MPC_TYPE_MAYBE ? MPC_DFA_OPT :
+        p->type == MPC_TYPE_MANY  ? MPC_DFA_STAR : MPC_DFA_PLUS,
+        p->type != MPC_TYPE_MANY1);
+      mpc_dfa_node_add(b, n, x);
+      return n;
+    
+    default: return -1;
+  }
+  
+}
+
+/*
+** Entries of the lists below are a leaf shifted
+** left by one, with the low bit set when the leaf
+** starts a `+`, or `MPC_DFA_END`. A list holds
+** what gets tried at some point, in the order
+** the combinators would try it.
+*/
+
+static void mpc_dfa_first(mpc_dfa_builder_t *b, int n, mpc_dfa_list_t *out) {
+  
+  int j;
+  mpc_dfa_node_t *m = &b->nodes[n];
+  
+  switch (m->type) {
+    case MPC_DFA_LEAF: mpc_dfa_list_add(out, m->leaf << 1); break;
+    case MPC_DFA_PLUS: mpc_dfa_list_add(out, (b->nodes[m->xs[0]].leaf << 1) | 1); break;
+    case MPC_DFA_OPT:
+    case MPC_DFA_STAR: mpc_dfa_first(b, m->xs[0], out); break;
+    case MPC_DFA_ALT:
+      for (j = 0; j < m->xs_num; j++) { mpc_dfa_first(b, m->xs[j], out); }
+      break;
+    case MPC_DFA_SEQ:
+      for (j = 0; j < m->xs_num; j++) {
+        mpc_dfa_first(b, m->xs[j], out);
+        if (!b->nodes[m->xs[j]].nullable) { break; }
+      }
+      break;
+  }
+  
+}
+
+static void mpc_dfa_follow(mpc_dfa_builder_t *b, int n, mpc_dfa_list_t *cont) {
+  
+  int j;
+  mpc_dfa_list_t c, t;
+  mpc_dfa_node_t *m = &b->nodes[n];
+  
+  switch (m->type) {
+    
+    case MPC_DFA_LEAF:
+      b->follows[m->leaf].num = 0;
+      mpc_dfa_list_cat(&b->follows[m->leaf], cont);
+      break;
+    
+    case MPC_DFA_PLUS:
+      j = b->nodes[m->xs[0]].leaf;
+      b->follows[j].num = 0;
+      mpc_dfa_list_add(&b->follows[j], j << 1);
+      mpc_dfa_list_cat(&b->follows[j], cont);
+      break;
+    
+    case MPC_DFA_OPT: mpc_dfa_follow(b, m->xs[0], cont); break;
+    
+    case MPC_DFA_STAR:
+      t.num = 0; t.xs = NULL;
+      mpc_dfa_first(b, m->xs[0], &t);
+      mpc_dfa_list_cat(&t, cont);
+      mpc_dfa_follow(b, m->xs[0], &t);
+      free(t.xs);
+      break;
+    
+    case MPC_DFA_ALT:
+      for (j = 0; j < m->xs_num; j++) { mpc_dfa_follow(b, m->xs[j], cont); }
+      break;
+    
+    case MPC_DFA_SEQ:
+      c.num = 0; c.xs = NULL;
+      mpc_dfa_list_cat(&c, cont);
+      for (j = m->xs_num-1; j >= 0; j--) {
+        mpc_dfa_follow(b, m->xs[j], &c);
+        t.num = 0; t.xs = NULL;
+        mpc_dfa_first(b, m->xs[j], &t);
+        if (b->nodes[m->xs[j]].nullable) { mpc_dfa_list_cat(&t, &c); }
+        free(c.xs);
+        c = t;
+      }
+      free(c.xs);
+      break;
+  }
+  
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  
+  int s, j;
+  for (s = 0; s < d->states_num; s++) {
+    for (j = 0; j < d->expected_num[s]; j++) { free(d->expected[s][j]); }
+    free(d->expected[s]);
+  }
+  
+  free(d->re);
+  free(d->trans);
+  free(d->accepts);
+  free(d->expected_num);
+  free(d->expected);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_build(mpc_dfa_builder_t *b, int top, const char *re, int soi, int eoi) {
+  
+  int s, j, k, c, l, dup;
+  char *m;
+  mpc_dfa_list_t start, *cur;
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+  
+  d->re = malloc(strlen(re) + 1);
+  strcpy(d->re, re);
+  d->soi = soi;
+  d->eoi = eoi;
+  d->states_num = b->leaves_num + 1;
+  d->trans = malloc(sizeof(short) * 256 * d->states_num);
+  d->accepts = calloc(d->states_num, 1);
+  d->expected_num = calloc(d->states_num, sizeof(int));
+  d->expected = calloc(d->states_num, sizeof(char**));
+  memset(d->trans, 0xFF, sizeof(short) * 256 * d->states_num);
+  
+  b->follows = calloc(b->leaves_num, sizeof(mpc_dfa_list_t));
+  
+  start.num = 0; start.xs = NULL;
+  mpc_dfa_list_add(&start, MPC_DFA_END);
+  mpc_dfa_follow(b, top, &start);
+  start.num = 0;
+  mpc_dfa_first(b, top, &start);
+  if (b->nodes[top].nullable) { mpc_dfa_list_add(&start, MPC_DFA_END); }
+  
+  /* State 0 is the start, state `l+1` follows leaf `l` */
+  
+  for (s = 0; s < d->states_num; s++) {
+    
+    cur = s == 0 ? &start : &b->follows[s-1];
+    
+    for (j = 0; j < cur->num; j++) {
+      
+      if (cur->xs[j] == MPC_DFA_END) { d->accepts[s] = 1; continue; }
+      
+      l = cur->xs[j] >> 1;
+      for (c = 1; c < 256; c++) {
+        if (!b->sets[l][c]) { continue; }
+        if (d->trans[s * 256 + c] != -1 && d->trans[s * 256 + c] != l+1) {
+          free(start.xs);
+          mpc_dfa_delete(d);
+          return NULL;
+        }
+        d->trans[s * 256 + c] = l+1;
+      }
+      
+      if (cur->xs[j] & 1) {
+        m = malloc(strlen("one or more of ") + strlen(b->msgs[l]) + 1);
+        strcpy(m, "one or more of ");
+        strcat(m, b->msgs[l]);
+      } else {
+        m = malloc(strlen(b->msgs[l]) + 1);
+        strcpy(m, b->msgs[l]);
+      }
+      
+      dup = 0;
+      for (k = 0; k < d->expected_num[s]; k++) {
+        if (strcmp(d->expected[s][k], m) == 0) { dup = 1; }
+      }
+      
+      if (dup) { free(m); continue; }
+      
+      d->expected_num[s]++;
+      d->expected[s] = realloc(d->expected[s], sizeof(char*) * d->expected_num[s]);
+      d->expected[s][d->expected_num[s]-1] = m;
+    }
+  }
+  
+  free(start.xs);
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re, mpc_parser_t *a) {
+  
+  int j, top, soi = 0, eoi = 0, anchors = 0;
+  mpc_parser_t *p = NULL;
+  mpc_dfa_t *d = NULL;
+  mpc_dfa_node_t *m;
+  mpc_dfa_builder_t b;
+  
+  b.nodes_num = 0;
+  b.nodes = NULL;
+  b.leaves_num = 0;
+  b.sets = NULL;
+  b.msgs = NULL;
+  b.follows = NULL;
+  
+  top = mpc_dfa_node(&b, a);
+  
+  /* Anchors may only open or close the whole regex */
+  
+  if (top != -1 && b.nodes[top].type != MPC_DFA_SEQ) {
+    j = top;
+    top = mpc_dfa_node_new(&b, MPC_DFA_SEQ, b.nodes[j].nullable);
+    mpc_dfa_node_add(&b, top, j);
+  }
+  
+  if (top != -1) {
+    
+    m = &b.nodes[top];
+    if (m->xs_num > 0 && b.nodes[m->xs[0]].type == MPC_DFA_SOI) {
+      soi = 1;
+      memmove(m->xs, m->xs + 1, sizeof(int) * (m->xs_num-1));
+      m->xs_num--;
+    }
+    if (m->xs_num > 0 && b.nodes[m->xs[m->xs_num-1]].type == MPC_DFA_EOI) {
+      eoi = 1;
+      m->xs_num--;
+    }
+    
+    for (j = 0; j < b.nodes_num; j++) {
+      if (b.nodes[j].type == MPC_DFA_SOI || b.nodes[j].type == MPC_DFA_EOI) { anchors++; }
+    }
+    
+    if (anchors == soi + eoi) {
+      d = mpc_dfa_build(&b, top, re, soi, eoi);
+    }
+  }
+  
+  if (d) {
+    p = mpc_undefined();
+    p->type = MPC_TYPE_DFA;
+    p->data.dfa.x = d;
+  }
+  
+  for (j = 0; j < b.nodes_num; j++) { free(b.nodes[j].xs); }
+  for (j = 0; b.follows && j < b.leaves_num; j++) { free(b.follows[j].xs); }
+  free(b.nodes);
+  free(b.sets);
+  free(b.msgs);
+  free(b.follows);
+  
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
-  mpc_parser_t *err_out;
+  mpc_parser_t *err_out, *dfa;
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
   
@@ -2062,6 +2915,12 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
+  dfa = mpc_re_dfa(re, r.output);
+  if (dfa) {
+    mpc_delete(r.output);
+    return dfa;
+  }
+  
   return r.output;
   
 }
@@ -2367,9 +3226,12 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA) { printf("/%s/", p->data.dfa.x->re); }
+  
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2516,6 +3378,29 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
 }
 
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a, size_t *size) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a == NULL) { return NULL; }
+  
+  r = mpc_ast_new(a->tag, a->contents);
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i], size);
+  }
+  
+  if (size) {
+    *size += sizeof(mpc_ast_t) + strlen(a->tag) + strlen(a->contents) + 2
+      + sizeof(mpc_ast_t*) * a->children_num;
+  }
+  
+  return r;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2733,6 +3618,13 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+static mpc_parser_t *mpca_memo(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
 /*
 ** Grammar Parser
 */
@@ -2959,7 +3851,10 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   
   mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
   
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  if (st->flags & MPCA_LANG_PREDICTIVE) { r.output = mpc_predictive(r.output); }
+  if (st->flags & MPCA_LANG_PACKRAT) { r.output = mpca_memo(r.output); }
+  
+  return r.output;
   
 }
 
@@ -3040,6 +3935,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
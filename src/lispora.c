@@ -1,58 +1,87 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "lispora.h"
 #include "../lib/mpc/mpc.h"
 
-#ifdef _WIN32
-
-#include <string.h>
 
-static char buffer[2048];
-
-char* readline(char* prompt) {
-	fputs(prompt, stdout);
-	fgets(buffer, 2048, stdin);
-	char* cpy = malloc(strlen(buffer) + 1);
-	strcpy(cpy, buffer);
-	cpy[strlen(cpy) - 1] = '\0';
-	return cpy;
-}
+/* Bytes read from a file at a time when streaming its lines */
+#define LLINES_SIZE (1 << 20)
 
-void add_history(char* unused) {};
+/* Bytes collected before buffered output is written out */
+#define LBUF_SIZE 65536
 
-#else
+/* Strings up to this length get concatenated by copying */
+#define LSTR_LEAF 64
 
-#include <editline/readline.h>
+/* Locations kept for the trail of an error, half of them innermost */
+#define LTRAIL_SIZE 16
+#define LTRAIL_HALF (LTRAIL_SIZE / 2)
 
-#endif
+/* Calls after which a lambda gets compiled to machine code */
+#define LJIT_THRESHOLD 64
 
-#define LASSERT(args, cond, fmt, ...) \
+#define LASSERT_WITH(args, cond, error) \
 	if (!(cond)) { \
-		lval* err = lval_err(fmt, ##__VA_ARGS__); \
+		lval* err = error; \
 		lval_del(args); \
 		return err; \
 	}
 
+#define LASSERT(args, cond, fmt, ...) \
+	LASSERT_WITH(args, cond, lval_err(fmt, ##__VA_ARGS__))
+
 #define LASSERT_TYPE(func, args, index, expect) \
-	LASSERT(args, args->cell[index]->type == expect, \
-			"Function '%s' passed incorrect type of argument %i. Got %s, expected %s.", \
-			func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+	LASSERT_WITH(args, args->cell[index]->type == expect, \
+			lval_err_type(func, index, args->cell[index]->type, expect))
 
 #define LASSERT_NUM_ARGS(func, args, num) \
-	LASSERT(args, args->count == num, \
-			"Function '%s' passed incorrect number of arguments. Got %i, expected %i.", \
-			func, args->count, num)
+	LASSERT_WITH(args, args->count == num, \
+			lval_err_args(func, args->count, num))
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-	LASSERT(args, args->cell[index]->count != 0, \
-			"Function '%s' passed {} for argument %i.", \
-			func, index)
+	LASSERT_WITH(args, args->cell[index]->count != 0, \
+			lval_err_empty(func, index))
 
 struct lval;
+struct lerr;
 struct lenv;
+struct lsym;
+struct ltask;
+struct lsched;
+struct llambda;
+struct lnode;
+struct lmemo;
+struct lcons;
+struct lstr;
+struct lseq;
+struct lgen;
+struct lpartial;
 
 typedef struct lval lval;
+typedef struct lerr lerr;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
+typedef struct ltask ltask;
+typedef struct lsched lsched;
+typedef struct llambda llambda;
+typedef struct lnode lnode;
+typedef struct lmemo lmemo;
+typedef struct lcons lcons;
+typedef struct lstr lstr;
+typedef struct lseq lseq;
+typedef struct lgen lgen;
+typedef struct lpartial lpartial;
 
 enum {
 	LVAL_NUM,
@@ -61,53 +90,501 @@ enum {
 	LVAL_STR,
 	LVAL_FUN,
 	LVAL_SEXPR,
-	LVAL_QEXPR
+	LVAL_QEXPR,
+	LVAL_FUT,
+	LVAL_SEQ
+};
+
+/* Kinds of errors */
+enum {
+	LERR_OTHER,
+	LERR_USER,
+	LERR_TYPE,
+	LERR_ARGS,
+	LERR_EMPTY,
+	LERR_UNBOUND,
+	LERR_DIV_ZERO
 };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Where an expression was read from, file is NULL if it was not */
+typedef struct {
+	lsym* file;
+	int row;
+	int col;
+} lloc;
+
 struct lval {
 	int type;
 
 	long num;
-	char* err;
-	char* sym;
-	char* str;
+	lerr* err;
+	lsym* sym;
+	lstr* str;
+
+	/* Position of the symbol in the frame of the lambda it belongs to, or -1 */
+	int slot;
 
 	/* Function */
 	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
+	llambda* lambda;
+	lpartial* partial;
+	lmemo* memo;
 
 	/* Expression */
 	int count;
 	lval** cell;
+	lloc loc;
+
+	/* Future */
+	ltask* task;
+
+	/* Lazy sequence */
+	lseq* seq;
+
+	/* Table the value is hash-consed in, with its references and hash */
+	lcons* cons;
+	atomic_int refs;
+	unsigned long hash;
+};
+
+// Errors are immutable and shared by reference count, with the payload in
+// the same allocation as the value. Common kinds keep what their message is
+// made of and only format it when it is first needed, so errors that get
+// caught or thrown away are never formatted.
+struct lerr {
+	int code;
+	const char* func;
+	int index;
+	int got;
+	int expect;
+	lsym* sym;
+	_Atomic(char*) msg;
 };
 
 struct lenv {
 	lenv* par;
+	lispora* interp;
 	int count;
-	char** syms;
+	lsym** syms;
 	lval** vals;
+
+	/* Leading bindings that are parameters of a call, with the symbols
+	   borrowed from the lambda and the values in the same allocation */
+	int params;
+	int borrowed;
+};
+
+// Symbols are interned per interpreter, so they can be compared by pointer.
+// Bindings of the root environment live in the symbol itself. Every binding
+// in any other environment counts as shadowing it, and only symbols that are
+// not shadowed anywhere can be looked up without walking the chain. Call
+// frames bind nothing but parameters, so a lambda counts those as shadowed
+// for as long as it lives, instead of every call counting them again.
+struct lsym {
+	char* name;
+	lval* global;
+	int version;
+	atomic_int shadow;
+};
+
+// A fork interns the symbols it reads into a table of its own, which falls
+// back to the table of its base and is freed along with the fork.
+typedef struct lsymtab {
+	struct lsymtab* par;
+	int count;
+	int size;
+	lsym** table;
+	lcons* cons;
+} lsymtab;
+
+// Hash-consed values of an interpreter and its forks. Structurally equal
+// values share one node, which is never changed, so equality is a pointer
+// compare. A node leaves the table when its last reference goes away.
+struct lcons {
+	int enabled;
+	int count;
+	int size;
+	lval** table;
+	pthread_mutex_t lock;
+};
+
+// Root bindings some compiled form of a lambda relies on, with the version
+// each had at the time. The form is only valid while none of them has been
+// rebound or shadowed since.
+typedef struct {
+	int count;
+	lsym** syms;
+	int* versions;
+} ldeps;
+
+// A lambda body compiled to a tree of closures. Each node evaluates one
+// expression through its function pointer, with whatever could be worked
+// out ahead of time already at hand.
+typedef lval* (*leval)(lenv* e, lnode* n);
+
+struct lnode {
+	leval eval;
+
+	/* Constant, or the symbol to look up */
+	lval* val;
+
+	/* Cells of an S-Expression */
+	int count;
+	lnode** nodes;
+	lloc loc;
+
+	/* Builtin the first cell resolved to, valid while 'op' keeps 'version' */
+	lsym* op;
+	int version;
+	lbuiltin builtin;
+
+	/* Branches of an 'if' */
+	lnode* then;
+	lnode* other;
+};
+
+// Machine code for a lambda. Returns 0 without side effects if the call
+// cannot be completed on numbers, in which case the body is interpreted.
+typedef int (*ljit_fn)(lenv* frame, long* out);
+
+typedef struct {
+	ljit_fn fn;
+	size_t size;
+	ldeps deps;
+} ljit;
+
+// Copies of a lambda share its formals and body, which never change once
+// the lambda is built. The formals are also kept as a signature: the
+// parameters without '&', of which the last one takes the rest if 'rest'.
+struct llambda {
+	atomic_int refs;
+	lval* formals;
+	lval* body;
+
+	int arity;
+	int rest;
+	lsym** params;
+
+	/* Body with constant subexpressions folded */
+	lval* code;
+	ldeps deps;
+
+	/* Closure trees for the body and the folded body, if enabled */
+	lnode* body_node;
+	lnode* code_node;
+
+	/* Compiled body, or one without code if it cannot be compiled */
+	atomic_int calls;
+	_Atomic(ljit*) jit;
+};
+
+// Arguments bound by partial application, one link per step. Each link
+// shares the ones before it, so a step only stores its own arguments, and
+// the whole chain is bound into a fresh frame once the lambda is saturated.
+struct lpartial {
+	atomic_int refs;
+	lpartial* prev;
+	int bound;
+	int count;
+	lval* args[];
+};
+
+/* Immutable string, shared between copies */
+
+// A leaf holds its characters, a concatenation its two halves. The halves
+// of a concatenation differ in height by at most one, so concatenating is
+// O(log n). Its characters get flattened into `flat` when first needed.
+struct lstr {
+	atomic_int refs;
+	size_t len;
+	int height;
+	lstr* left;
+	lstr* right;
+	_Atomic(char*) flat;
+	char data[];
+};
+
+/* Lazily realized sequence */
+
+// Produces the items of a sequence one at a time, NULL at the end. All
+// unrealized nodes of a sequence share it and realize under its lock.
+struct lgen {
+	atomic_int refs;
+	pthread_mutex_t lock;
+	lval* (*next)(lgen* g);
+	void (*free)(lgen* g);
+};
+
+// A node gets realized once, into its first item and the rest of the
+// sequence or into the end. Realized nodes are kept, so a sequence can be
+// walked again and from several threads.
+struct lseq {
+	atomic_int refs;
+	atomic_int realized;
+	lval* first;
+	lseq* rest;
+	lgen* gen;
+};
+
+// Lines of a file, split in a large read buffer.
+typedef struct {
+	lgen gen;
+	FILE* file;
+	char* buf;
+	size_t start;
+	size_t len;
+	size_t cap;
+	int error;
+} llines;
+
+typedef struct {
+	lgen gen;
+	lval* list;
+	int next;
+} llist;
+
+typedef struct {
+	lgen gen;
+	long next;
+	long end;
+	long step;
+} lrange;
+
+typedef struct {
+	lgen gen;
+	lenv* env;
+	lval* func;
+	lval* x;
+	int started;
+} literate;
+
+typedef struct {
+	lgen gen;
+	lenv* env;
+	lval* func;
+	lseq* source;
+} lmapped;
+
+typedef struct {
+	lgen gen;
+	int count;
+	int next;
+	lseq** parts;
+} ljoined;
+
+/* Output collected into large writes */
+
+// Writes to the file whenever it is full. Without a file it grows instead,
+// which is how values get printed to strings.
+typedef struct {
+	FILE* file;
+	char* data;
+	size_t len;
+	size_t cap;
+} lbuf;
+
+/* Cache of a memoized function */
+
+typedef struct {
+	unsigned long hash;
+	lval* args;
+	lval* result;
+
+	/* Neighbours in the order of use, most recent first */
+	int prev;
+	int next;
+} lmemo_entry;
+
+// Entries are kept in a fixed array and found through an open addressing
+// table of their indices. Once full, the least recently used one is reused.
+struct lmemo {
+	atomic_int refs;
+	lval* func;
+	lsymtab* syms;
+	pthread_mutex_t lock;
+
+	int capacity;
+	int count;
+	lmemo_entry* entries;
+	int first;
+	int last;
+
+	int size;
+	int* slots;
+};
+
+/* Work-stealing scheduler shared by the parallel builtins */
+
+typedef struct {
+	lenv* env;
+	lval* func;
+	lval* items;
+	lval* init;
+	lval** results;
+	int chunk_size;
+	int chunks;
+	atomic_int pending;
+} ljob;
+
+struct ltask {
+	void (*run)(ltask* t);
+
+	/* Function application */
+	lenv* env;
+	lval* func;
+	lval* args;
+	lval* result;
+
+	/* Chunk of a parallel job */
+	ljob* job;
+	int chunk;
+
+	lsched* sched;
+
+	/* Next task in the injection queue */
+	ltask* next;
+
+	atomic_int done;
+	atomic_int refs;
 };
 
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Program;
+// Chase-Lev deque. The owning worker pushes and takes at the bottom, other
+// workers steal from the top. Grown arrays keep a link to the one they
+// replaced, since a thief may still be reading it.
+typedef struct ltask_array {
+	long size;
+	struct ltask_array* prev;
+	_Atomic(ltask*) tasks[];
+} ltask_array;
+
+typedef struct {
+	atomic_long top;
+	atomic_long bottom;
+	_Atomic(ltask_array*) array;
+	lsched* sched;
+} ldeque;
+
+// Workers push their tasks onto their own deque. Threads outside of the pool
+// have none, so they append to the injection queue under the lock instead.
+struct lsched {
+	int requested;
+	int size;
+	pthread_t* threads;
+	ldeque* deques;
+	ltask* inject;
+	ltask* inject_last;
+	atomic_int injected;
+	atomic_int started;
+	atomic_int queued;
+	atomic_int outstanding;
+	atomic_int sleeping;
+	atomic_int shutdown;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+};
+
+// Index of the deque owned by the current thread, or -1 for threads outside
+// of the pool, such as the ones evaluating top-level code.
+_Thread_local int lworker = -1;
+
+// Set while the current thread runs a task. Only the root environment is
+// shared with running tasks and it stays read-only until they finish.
+_Thread_local int lparallel = 0;
+
+// Locations of the expressions the latest error of a thread came up
+// through, innermost first. Recording them allocates nothing. Once full,
+// the second half becomes a ring of the outermost ones, so a deep trail
+// keeps both the failing expression and the top-level one it started from.
+_Thread_local struct {
+	lval* err;
+	int count;
+	int dropped;
+	lloc locs[LTRAIL_SIZE];
+} ltrail;
+
+struct lispora {
+	mpc_parser_t* Number;
+	mpc_parser_t* Symbol;
+	mpc_parser_t* String;
+	mpc_parser_t* Comment;
+	mpc_parser_t* Sexpr;
+	mpc_parser_t* Expr;
+	mpc_parser_t* Qexpr;
+	mpc_parser_t* Program;
+
+	/* Parser stacks kept from one eval to the next */
+	mpc_context_t* parse;
+
+	lenv* env;
+	lsymtab* syms;
+	lsched* sched;
+
+	/* Output of `print` and top-level errors, flushed after every eval */
+	lbuf out;
+	pthread_mutex_t out_lock;
+
+	int jit;
+	int closures;
+
+	/* Interpreter this one was forked from */
+	lispora* base;
+};
 
 char* ltype_name(int t);
 
 lval* lval_num(long num);
 
+char* lerr_vformat(char* fmt, va_list va);
+
+char* lerr_format(char* fmt, ...);
+
+lval* lval_error(int code);
+
 lval* lval_err(char* fmt, ...);
 
-lval* lval_sym(char* sym);
+lval* lval_err_type(const char* func, int index, int got, int expect);
+
+lval* lval_err_args(const char* func, int got, int expect);
+
+lval* lval_err_empty(const char* func, int index);
+
+lval* lval_err_unbound(lsym* sym);
+
+char* lerr_message(lerr* err);
+
+void ltrail_reset(void);
+
+lval* ltrail_add(lval* x, lloc* loc);
+
+void ltrail_print(lbuf* b, lval* err);
+
+char* lval_report(lval* x);
+
+lsymtab* lsymtab_new(void);
+
+void lsymtab_del(lsymtab* t);
+
+lcons* lcons_new(void);
+
+void lcons_free(lcons* c);
+
+int lval_same(lval* x, lval* v);
+
+lval* lval_intern(lcons* c, lval* v);
+
+void lcons_release(lval* v);
+
+lval* lval_own(lval* v);
+
+lval* lval_unshare(lval* v);
+
+lsym* lsym_find(lsymtab* t, char* name);
+
+lsym* lsym_intern(lsymtab* t, char* name);
+
+lval* lval_sym(lsym* sym);
 
 lval* lval_str(char* str);
 
@@ -119,25 +596,109 @@ lval* lval_fun(lbuiltin func);
 
 lval* lval_lambda(lval* formals, lval* body);
 
+void llambda_release(llambda* l);
+
+void ldeps_add(ldeps* d, lsym* sym);
+
+int ldeps_valid(ldeps* d);
+
+void ldeps_free(ldeps* d);
+
+int lval_pure(lbuiltin func);
+
+lval* lval_fold(lenv* e, llambda* l, lval* v);
+
+int lval_inlinable(llambda* callee, lval* v, int* uses, int* size);
+
+lval* lval_substitute(llambda* l, llambda* callee, lval* v, lval* call);
+
+lval* lval_inline(llambda* l, lsym* op, lval* call);
+
+lval* lval_fold_quoted(lenv* e, llambda* l, lval* v);
+
+void llambda_fold(llambda* l, lenv* e);
+
+lval* llambda_code(llambda* l);
+
+lnode* lnode_new(leval eval);
+
+lnode* lnode_compile(lval* v);
+
+lnode* lnode_branch(lval* v);
+
+void lnode_del(lnode* n);
+
+lval* lnode_const(lenv* e, lnode* n);
+
+lval* lnode_sym(lenv* e, lnode* n);
+
+lval* lnode_sexpr(lenv* e, lnode* n);
+
+lval* lnode_builtin(lenv* e, lnode* n);
+
+lval* lnode_if(lenv* e, lnode* n);
+
+lval* llambda_eval(llambda* l, lenv* frame);
+
+lpartial* lpartial_new(lpartial* prev, lval* args);
+
+void lpartial_bind(lpartial* p, lenv* frame);
+
+void lpartial_release(lpartial* p);
+
+int ljit_call(lenv* frame, lval* sym, long* argv, int argc, long* out);
+
+ljit* ljit_compile(llambda* l);
+
+ljit* ljit_install(llambda* l, lenv* e);
+
+void ljit_free(ljit* j);
+
+ljit_fn ljit_code(llambda* l, lenv* e);
+
+void lval_address(lval* v, lval* formals);
+
+lval* lval_fut(ltask* task);
+
 void lval_del(lval* v);
 
 lval* lval_copy(lval* v);
 
+lval* lval_clone(lval* v);
+
 lval* lval_add(lval* v, lval* x);
 
 lval* lval_read_num(mpc_ast_t* tree);
 
 lval* lval_read_str(mpc_ast_t* tree);
 
-lval* lval_read(mpc_ast_t* tree);
+lval* lval_read(lsymtab* syms, lsym* file, mpc_ast_t* tree);
+
+void lbuf_init(lbuf* b, FILE* file);
 
-void lval_print_str(lval* v);
+void lbuf_free(lbuf* b);
 
-void lval_expr_print(lval* v, char open, char close);
+void lbuf_drain(lbuf* b);
 
-void lval_print(lval* v);
+void lbuf_put(lbuf* b, const char* str, size_t len);
 
-void lval_println(lval* v);
+void lbuf_puts(lbuf* b, const char* str);
+
+void lbuf_putc(lbuf* b, char c);
+
+void lbuf_num(lbuf* b, long num);
+
+void lbuf_chars(lbuf* b, lstr* s, int escape);
+
+void lval_print_str(lbuf* b, lval* v);
+
+void lval_expr_print(lbuf* b, lval* v, char open, char close);
+
+void lval_print(lbuf* b, lval* v);
+
+void lval_println(lbuf* b, lval* v);
+
+char* lval_to_string(lval* v);
 
 lval* lval_pop(lval* v, int i);
 
@@ -145,18 +706,26 @@ lval* lval_take(lval* v, int i);
 
 lval* lval_eval_sexpr(lenv* e, lval* v);
 
+lval* lval_invoke(lenv* e, lval* v);
+
 lval* lval_call(lenv* e, lval* func, lval* args);
 
 lenv* lenv_new(void);
 
+lenv* lenv_frame(lenv* par, llambda* l);
+
+lenv* lenv_top(lenv* e);
+
+lispora* lenv_interp(lenv* e);
+
 void lenv_del(lenv* e);
 
 lval* lenv_get(lenv* e, lval* key);
 
-lenv* lenv_copy(lenv* e);
-
 void lenv_put(lenv* e, lval* key, lval* v);
 
+void lenv_bind(lenv* e, lsym* sym, lval* v);
+
 void lenv_def(lenv* e, lval* key, lval* v);
 
 lval* builtin_head(lenv* e, lval* args);
@@ -193,6 +762,8 @@ lval* builtin_le(lenv* e, lval* args);
 
 int lval_eq(lval* first, lval* second);
 
+unsigned long lval_hash(lval* v);
+
 lval* builtin_cmp(lenv* e, lval* args, char* op);
 
 lval* builtin_eq(lenv* e, lval* args);
@@ -207,12 +778,206 @@ lval* builtin_def(lenv* e, lval* args);
 
 lval* builtin_put(lenv* e, lval* args);
 
+lval* lval_import(lenv* e, char* filename);
+
+lval* lval_eval_program(lenv* e, const char* name, mpc_ast_t* tree);
+
 lval* builtin_import(lenv* e, lval* args);
 
 lval* builtin_print(lenv* e, lval* args);
 
 lval* builtin_error(lenv* e, lval* args);
 
+lval* builtin_try(lenv* e, lval* args);
+
+lval* builtin_output(lenv* e, lval* args, char* func, char* mode);
+
+lval* builtin_write_file(lenv* e, lval* args);
+
+lval* builtin_append_file(lenv* e, lval* args);
+
+lval* builtin_flush(lenv* e, lval* args);
+
+void lispora_flush(lispora* l);
+
+int lispora_parse_failed(mpc_result_t* r, char** result);
+
+int lispora_finish(lispora* l, lval* x, char** result);
+
+lval* lval_apply(lenv* e, lval* func, lval* args);
+
+void ldeque_init(ldeque* d);
+
+void ldeque_free(ldeque* d);
+
+void ldeque_push(ldeque* d, ltask* t);
+
+ltask* ldeque_take(ldeque* d);
+
+ltask* ldeque_steal(ldeque* d);
+
+void lsched_start(lsched* s);
+
+void lsched_shutdown(lsched* s);
+
+void* lsched_worker(void* deque);
+
+void lsched_push(lsched* s, ltask* t);
+
+ltask* lsched_inject_take(lsched* s);
+
+int lsched_help(lsched* s);
+
+void lsched_quiesce(lsched* s);
+
+ltask* ltask_new(lsched* s, void (*run)(ltask* t));
+
+void ltask_exec(ltask* t);
+
+void ltask_release(ltask* t);
+
+void ltask_apply(ltask* t);
+
+void ltask_chunk(ltask* t);
+
+void ljob_chunk(ljob* job, int c);
+
+void ljob_exec(lsched* s, ljob* job);
+
+lval* builtin_pmap(lenv* e, lval* args);
+
+lval* builtin_preduce(lenv* e, lval* args);
+
+lval* builtin_spawn(lenv* e, lval* args);
+
+lval* builtin_await(lenv* e, lval* args);
+
+lmemo* lmemo_new(lsymtab* syms, lval* func, int capacity);
+
+void lmemo_release(lmemo* m);
+
+int lmemo_find(lmemo* m, unsigned long hash, lval* args);
+
+void lmemo_unlink(lmemo* m, int i);
+
+void lmemo_touch(lmemo* m, int i);
+
+void lmemo_remove(lmemo* m, int i);
+
+void lmemo_insert(lmemo* m, unsigned long hash, lval* args, lval* result);
+
+int lmemo_keeps(lmemo* m, lval* v);
+
+lval* lmemo_call(lenv* e, lmemo* m, lval* args);
+
+lval* builtin_memoized(lenv* e, lval* args);
+
+lval* builtin_memo(lenv* e, lval* args);
+
+lstr* lstr_new(char* str, size_t len);
+
+lstr* lstr_ref(lstr* s);
+
+void lstr_release(lstr* s);
+
+lstr* lstr_node(lstr* left, lstr* right);
+
+lstr* lstr_rotate_left(lstr* s);
+
+lstr* lstr_rotate_right(lstr* s);
+
+lstr* lstr_join_right(lstr* left, lstr* right);
+
+lstr* lstr_join_left(lstr* left, lstr* right);
+
+lstr* lstr_join(lstr* left, lstr* right);
+
+lstr* lstr_sub(lstr* s, size_t start, size_t len);
+
+void lstr_write(lstr* s, char* out);
+
+char* lstr_chars(lstr* s);
+
+int lstr_eq(lstr* first, lstr* second);
+
+char* lstr_find(char* chars, size_t len, char* needle, size_t size);
+
+lval* lval_lstr(lstr* str);
+
+lval* builtin_concat(lenv* e, lval* args);
+
+lval* builtin_substring(lenv* e, lval* args);
+
+lval* builtin_index_of(lenv* e, lval* args);
+
+lval* builtin_split(lenv* e, lval* args);
+
+lval* builtin_length(lenv* e, lval* args);
+
+void lgen_init(lgen* g, lval* (*next)(lgen* g), void (*free)(lgen* g));
+
+void lgen_release(lgen* g);
+
+lseq* lseq_new(lgen* gen);
+
+lseq* lseq_ref(lseq* s);
+
+void lseq_release(lseq* s);
+
+lval* lseq_first(lseq* s);
+
+lval* lval_seq(lseq* seq);
+
+int lseq_eq(lseq* s, lval* x);
+
+llines* llines_open(char* path);
+
+int llines_read(llines* r, char** line, size_t* len);
+
+lval* llines_next(lgen* g);
+
+void llines_free(lgen* g);
+
+lval* builtin_read_lines(lenv* e, lval* args);
+
+lval* builtin_lines(lenv* e, lval* args, char* func, int fold);
+
+lval* builtin_fold_lines(lenv* e, lval* args);
+
+lval* builtin_for_each_line(lenv* e, lval* args);
+
+lval* llist_next(lgen* g);
+
+void llist_free(lgen* g);
+
+lseq* lseq_of(lval* v);
+
+lval* lrange_next(lgen* g);
+
+void lrange_free(lgen* g);
+
+lval* literate_next(lgen* g);
+
+void literate_free(lgen* g);
+
+lval* lmapped_next(lgen* g);
+
+void lmapped_free(lgen* g);
+
+lval* ljoined_next(lgen* g);
+
+void ljoined_free(lgen* g);
+
+lval* lval_join_lazy(lval* args);
+
+lval* builtin_range(lenv* e, lval* args);
+
+lval* builtin_iterate(lenv* e, lval* args);
+
+lval* builtin_lazy_map(lenv* e, lval* args);
+
+lval* builtin_fold(lenv* e, lval* args);
+
 lval* builtin(lval* args, char* sym);
 
 lval* lval_eval(lenv* e, lval* v);
@@ -226,823 +991,4166 @@ char* ltype_name(int t) {
 		case LVAL_STR: return "String";
 		case LVAL_SEXPR: return "S-Expression";
 		case LVAL_QEXPR: return "Q-Expression";
+		case LVAL_FUT: return "Future";
+		case LVAL_SEQ: return "Sequence";
 		default: return "Unknown";
 	}
 }
 
 lval* lval_num(long num) {
 	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
 	v->type = LVAL_NUM;
 	v->num = num;
 	return v;
 }
 
-lval* lval_err(char* fmt, ...) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
+char* lerr_vformat(char* fmt, va_list va) {
+	va_list again;
+	va_copy(again, va);
+	int len = vsnprintf(NULL, 0, fmt, va);
+
+	char* msg = malloc(len + 1);
+	vsnprintf(msg, len + 1, fmt, again);
+	va_end(again);
 
+	return msg;
+}
+
+char* lerr_format(char* fmt, ...) {
 	va_list va;
 	va_start(va, fmt);
+	char* msg = lerr_vformat(fmt, va);
+	va_end(va);
+	return msg;
+}
 
-	v->err = malloc(512);
-	vsnprintf(v->err, 512 - 1, fmt, va);
-	v->err = realloc(v->err, strlen(v->err)+1);
+lval* lval_error(int code) {
+	ltrail_reset();
 
-	va_end(va);
+	lval* v = malloc(sizeof(lval) + sizeof(lerr));
+	v->cons = NULL;
+	v->type = LVAL_ERR;
+	atomic_init(&v->refs, 1);
 
+	v->err = (lerr*) (v + 1);
+	v->err->code = code;
+	v->err->func = NULL;
+	v->err->sym = NULL;
+	atomic_init(&v->err->msg, NULL);
 	return v;
 }
 
-lval* lval_sym(char* sym) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(sym) + 1);
-	strcpy(v->sym, sym);
+// The arguments are formatted right away, as they may not outlive the call.
+lval* lval_err(char* fmt, ...) {
+	va_list va;
+	va_start(va, fmt);
+	char* msg = lerr_vformat(fmt, va);
+	va_end(va);
+
+	lval* v = lval_error(LERR_OTHER);
+	atomic_store_explicit(&v->err->msg, msg, memory_order_relaxed);
 	return v;
 }
 
-lval* lval_str(char* str) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_STR;
-	v->str = malloc(strlen(str) + 1);
-	strcpy(v->str, str);
+// The function names given to these must be static.
+lval* lval_err_type(const char* func, int index, int got, int expect) {
+	lval* v = lval_error(LERR_TYPE);
+	v->err->func = func;
+	v->err->index = index;
+	v->err->got = got;
+	v->err->expect = expect;
 	return v;
 }
 
-lval* lval_sexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
-	v->count = 0;
-	v->cell = NULL;
+lval* lval_err_args(const char* func, int got, int expect) {
+	lval* v = lval_error(LERR_ARGS);
+	v->err->func = func;
+	v->err->got = got;
+	v->err->expect = expect;
 	return v;
 }
 
-lval* lval_qexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
-	v->count = 0;
-	v->cell = NULL;
+lval* lval_err_empty(const char* func, int index) {
+	lval* v = lval_error(LERR_EMPTY);
+	v->err->func = func;
+	v->err->index = index;
 	return v;
 }
 
-lval* lval_fun(lbuiltin func) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
-	v->builtin = func;
+lval* lval_err_unbound(lsym* sym) {
+	lval* v = lval_error(LERR_UNBOUND);
+	v->err->sym = sym;
 	return v;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
-
-	v->builtin = NULL;
-	v->env = lenv_new();
+// Never freed, copying and deleting it does nothing.
+static lerr lerr_div_zero = {.code = LERR_DIV_ZERO, .msg = "Division by zero."};
+static lval lval_div_zero = {.type = LVAL_ERR, .err = &lerr_div_zero, .refs = -1};
 
-	v->formals = formals;
-	v->body = body;
-	return v;
-}
+char* lerr_message(lerr* err) {
+	char* msg = atomic_load_explicit(&err->msg, memory_order_acquire);
+	if (msg) {
+		return msg;
+	}
 
-void lval_del(lval* v) {
-	switch (v->type) {
-		case LVAL_NUM:
+	switch (err->code) {
+		case LERR_TYPE:
+			msg = lerr_format("Function '%s' passed incorrect type of argument %i. Got %s, expected %s.",
+					err->func, err->index, ltype_name(err->got), ltype_name(err->expect));
 			break;
-		case LVAL_SYM:
-			free(v->sym);
+		case LERR_ARGS:
+			msg = lerr_format("Function '%s' passed incorrect number of arguments. Got %i, expected %i.",
+					err->func, err->got, err->expect);
 			break;
-		case LVAL_STR:
-			free(v->str);
+		case LERR_EMPTY:
+			msg = lerr_format("Function '%s' passed {} for argument %i.", err->func, err->index);
 			break;
-		case LVAL_ERR:
-			free(v->err);
+		case LERR_UNBOUND:
+			msg = lerr_format("Unbound symbol: '%s'", err->sym->name);
 			break;
-		case LVAL_QEXPR:
-		case LVAL_SEXPR:
-			for (int i = 0; i < v->count; ++i) {
-				lval_del(v->cell[i]);
+		default:
+			msg = lerr_format("Unknown error.");
+			break;
+	}
+
+	char* expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&err->msg, &expected, msg,
+				memory_order_acq_rel, memory_order_acquire)) {
+		free(msg);
+		return expected;
+	}
+	return msg;
+}
+
+void ltrail_reset(void) {
+	ltrail.err = NULL;
+	ltrail.count = 0;
+	ltrail.dropped = 0;
+}
+
+// Notes that the value came out of the expression at the location, if it
+// is an error. Returns the value.
+lval* ltrail_add(lval* x, lloc* loc) {
+	if (x->type != LVAL_ERR || !loc->file) {
+		return x;
+	}
+
+	if (ltrail.err != x) {
+		ltrail_reset();
+		ltrail.err = x;
+	}
+
+	lloc* last = NULL;
+	if (ltrail.dropped) {
+		last = &ltrail.locs[LTRAIL_HALF + (ltrail.dropped - 1) % LTRAIL_HALF];
+	} else if (ltrail.count) {
+		last = &ltrail.locs[ltrail.count - 1];
+	}
+	if (last && last->file == loc->file && last->row == loc->row && last->col == loc->col) {
+		return x;
+	}
+
+	if (ltrail.count < LTRAIL_SIZE) {
+		ltrail.locs[ltrail.count++] = *loc;
+	} else {
+		ltrail.locs[LTRAIL_HALF + ltrail.dropped++ % LTRAIL_HALF] = *loc;
+	}
+	return x;
+}
+
+// Prints the trail of the error, if it is the latest one, and forgets it.
+void ltrail_print(lbuf* b, lval* err) {
+	if (ltrail.err == err) {
+		for (int i = 0; i < ltrail.count; ++i) {
+			lloc* loc = &ltrail.locs[i];
+			if (ltrail.dropped && i >= LTRAIL_HALF) {
+				if (i == LTRAIL_HALF) {
+					lbuf_puts(b, "\n  ... ");
+					lbuf_num(b, ltrail.dropped);
+					lbuf_puts(b, " more");
+				}
+				loc = &ltrail.locs[LTRAIL_HALF + (ltrail.dropped + i) % LTRAIL_HALF];
 			}
 
-			free(v->cell);
-			break;
-		case LVAL_FUN:
-			if (!v->builtin) {
-				lenv_del(v->env);
-				lval_del(v->formals);
-				lval_del(v->body);
+			lbuf_puts(b, "\n  at ");
+			lbuf_puts(b, loc->file->name);
+			lbuf_putc(b, ':');
+			lbuf_num(b, loc->row);
+			lbuf_putc(b, ':');
+			lbuf_num(b, loc->col);
+		}
+	}
+	ltrail_reset();
+}
+
+lsymtab* lsymtab_new(void) {
+	lsymtab* t = malloc(sizeof(lsymtab));
+	t->par = NULL;
+	t->count = 0;
+	t->size = 256;
+	t->table = calloc(t->size, sizeof(lsym*));
+	t->cons = NULL;
+	return t;
+}
+
+void lsymtab_del(lsymtab* t) {
+	// Lambdas in globals still count their parameters as shadowed, so all
+	// of them go before any symbol.
+	for (int i = 0; i < t->size; ++i) {
+		if (t->table[i] && t->table[i]->global) {
+			lval_del(t->table[i]->global);
+		}
+	}
+	for (int i = 0; i < t->size; ++i) {
+		if (t->table[i]) {
+			free(t->table[i]->name);
+			free(t->table[i]);
+		}
+	}
+	if (t->cons && (!t->par || t->cons != t->par->cons)) {
+		lcons_free(t->cons);
+	}
+	free(t->table);
+	free(t);
+}
+
+unsigned long lsym_hash(char* name) {
+	unsigned long h = 14695981039346656037UL;
+	while (*name) {
+		h = (h ^ (unsigned char) *name++) * 1099511628211UL;
+	}
+	return h;
+}
+
+// Looks the name up in the table and the ones it falls back to.
+lsym* lsym_find(lsymtab* t, char* name) {
+	for (; t; t = t->par) {
+		unsigned long i = lsym_hash(name) & (t->size - 1);
+		while (t->table[i]) {
+			if (!strcmp(t->table[i]->name, name)) {
+				return t->table[i];
 			}
-			break;
+			i = (i + 1) & (t->size - 1);
+		}
+	}
+	return NULL;
+}
+
+lsym* lsym_intern(lsymtab* t, char* name) {
+	lsym* found = lsym_find(t->par, name);
+	if (found) {
+		return found;
 	}
 
-	free(v);
+	unsigned long i = lsym_hash(name) & (t->size - 1);
+	while (t->table[i]) {
+		if (!strcmp(t->table[i]->name, name)) {
+			return t->table[i];
+		}
+		i = (i + 1) & (t->size - 1);
+	}
+
+	lsym* sym = malloc(sizeof(lsym));
+	sym->name = malloc(strlen(name) + 1);
+	strcpy(sym->name, name);
+	sym->global = NULL;
+	sym->version = 0;
+	atomic_init(&sym->shadow, 0);
+	t->table[i] = sym;
+
+	// Keep the table at most half full.
+	if (++t->count * 2 > t->size) {
+		lsym** old = t->table;
+		int size = t->size;
+
+		t->size *= 2;
+		t->table = calloc(t->size, sizeof(lsym*));
+		for (int j = 0; j < size; ++j) {
+			if (old[j]) {
+				unsigned long k = lsym_hash(old[j]->name) & (t->size - 1);
+				while (t->table[k]) {
+					k = (k + 1) & (t->size - 1);
+				}
+				t->table[k] = old[j];
+			}
+		}
+		free(old);
+	}
+
+	return sym;
 }
 
-lval* lval_copy(lval* v) {
-	lval* copy = malloc(sizeof(lval));
-	copy->type = v->type;
+lcons* lcons_new(void) {
+	lcons* c = malloc(sizeof(lcons));
+	c->enabled = 1;
+	c->count = 0;
+	c->size = 256;
+	c->table = calloc(c->size, sizeof(lval*));
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+void lcons_free(lcons* c) {
+	pthread_mutex_destroy(&c->lock);
+	free(c->table);
+	free(c);
+}
+
+// Whether a consed node stands for the value, given that the cells of both
+// are consed already.
+int lval_same(lval* x, lval* v) {
+	if (x->type != v->type) {
+		return 0;
+	}
 
 	switch (v->type) {
-		case LVAL_FUN:
-			if (v->builtin) {
-				copy->builtin = v->builtin;
-			} else {
-				copy->builtin = NULL;
-				copy->env = lenv_copy(v->env);
-				copy->formals = lval_copy(v->formals);
-				copy->body = lval_copy(v->body);
+		case LVAL_NUM:
+			return x->num == v->num;
+		case LVAL_SYM:
+			return x->sym == v->sym;
+		case LVAL_STR:
+			return lstr_eq(x->str, v->str);
+		default:
+			if (x->count != v->count) {
+				return 0;
 			}
-			break;
+			for (int i = 0; i < v->count; ++i) {
+				if (x->cell[i] != v->cell[i]) {
+					return 0;
+				}
+			}
+			return 1;
+	}
+}
+
+// Takes the value and returns the shared node for it. Only numbers,
+// strings, symbols and expressions made of those can be consed, anything
+// else comes back as it is.
+lval* lval_intern(lcons* c, lval* v) {
+	if (!c || !c->enabled || v->cons) {
+		return v;
+	}
+
+	switch (v->type) {
 		case LVAL_NUM:
-			copy->num = v->num;
-			break;
-		case LVAL_ERR:
-			copy->err = malloc(strlen(v->err) + 1);
-			strcpy(copy->err, v->err);
-			break;
 		case LVAL_SYM:
-			copy->sym = malloc(strlen(v->sym) + 1);
-			strcpy(copy->sym, v->sym);
-			break;
 		case LVAL_STR:
-			copy->str = malloc(strlen(v->str) + 1);
-			strcpy(copy->str, v->str);
 			break;
-
-		case LVAL_QEXPR:
 		case LVAL_SEXPR:
-			copy->count = v->count;
-			copy->cell = malloc(sizeof(lval*) * copy->count);
-			for (int i = 0; i < copy->count; ++i) {
-				copy->cell[i] = lval_copy(v->cell[i]);
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; ++i) {
+				v->cell[i] = lval_intern(c, v->cell[i]);
+			}
+			for (int i = 0; i < v->count; ++i) {
+				if (!v->cell[i]->cons) {
+					return v;
+				}
 			}
 			break;
+		default:
+			return v;
 	}
 
-	return copy;
-}
+	unsigned long hash = lval_hash(v);
 
-lval* lval_add(lval* v, lval* x) {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	v->cell[v->count-1] = x;
-	return v;
-}
+	pthread_mutex_lock(&c->lock);
+	unsigned long i = hash & (c->size - 1);
+	for (; c->table[i]; i = (i + 1) & (c->size - 1)) {
+		lval* x = c->table[i];
+		if (x->hash != hash || !lval_same(x, v)) {
+			continue;
+		}
 
-lval* lval_read_num(mpc_ast_t* tree) {
-	errno = 0;
-	long x = strtol(tree->contents, NULL, 10);
-	if (errno != ERANGE) {
-		return lval_num(x);
-	} else {
-		return lval_err("Invalid number");
+		// A node whose last reference is being dropped must not come back.
+		int refs = atomic_load_explicit(&x->refs, memory_order_relaxed);
+		while (refs > 0 && !atomic_compare_exchange_weak_explicit(&x->refs, &refs, refs + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+		}
+		if (refs > 0) {
+			pthread_mutex_unlock(&c->lock);
+			lval_del(v);
+			return x;
+		}
 	}
-}
-
-lval* lval_read_str(mpc_ast_t* tree) {
-	tree->contents[strlen(tree->contents)-1] = '\0';
-	char* unescaped = malloc(strlen(tree->contents+1)+1);
 
-	strcpy(unescaped, tree->contents+1);
-	unescaped = mpcf_unescape(unescaped);
+	v->cons = c;
+	v->hash = hash;
+	atomic_init(&v->refs, 1);
+	c->table[i] = v;
+
+	// Keep the table at most half full.
+	if (++c->count * 2 > c->size) {
+		lval** old = c->table;
+		int size = c->size;
+
+		c->size *= 2;
+		c->table = calloc(c->size, sizeof(lval*));
+		for (int j = 0; j < size; ++j) {
+			if (old[j]) {
+				unsigned long k = old[j]->hash & (c->size - 1);
+				while (c->table[k]) {
+					k = (k + 1) & (c->size - 1);
+				}
+				c->table[k] = old[j];
+			}
+		}
+		free(old);
+	}
 
-	lval* str = lval_str(unescaped);
-	free(unescaped);
-	return str;
+	pthread_mutex_unlock(&c->lock);
+	return v;
 }
 
-lval* lval_read(mpc_ast_t* tree) {
-	if (strstr(tree->tag, "number")) {
-		return lval_read_num(tree);
+// Drops a reference to a consed node. The last one takes it out of the
+// table, moving later entries of its probe sequence back, and frees it.
+void lcons_release(lval* v) {
+	if (atomic_fetch_sub_explicit(&v->refs, 1, memory_order_acq_rel) != 1) {
+		return;
 	}
 
-	if (strstr(tree->tag, "symbol")) {
-		return lval_sym(tree->contents);
-	}
+	lcons* c = v->cons;
+	unsigned long mask = c->size - 1;
 
-	if (strstr(tree->tag, "string")) {
-		return lval_read_str(tree);
+	pthread_mutex_lock(&c->lock);
+	unsigned long hole = v->hash & mask;
+	while (c->table[hole] != v) {
+		hole = (hole + 1) & mask;
 	}
 
-	lval* x = NULL;
-	if ((!strcmp(tree->tag, ">")) || strstr(tree->tag, "sexpr")) {
-		x = lval_sexpr();
+	for (unsigned long j = (hole + 1) & mask; c->table[j]; j = (j + 1) & mask) {
+		unsigned long home = c->table[j]->hash & mask;
+		int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+		if (!stays) {
+			c->table[hole] = c->table[j];
+			hole = j;
+		}
 	}
+	c->table[hole] = NULL;
+	c->count--;
+	pthread_mutex_unlock(&c->lock);
 
-	if (strstr(tree->tag, "qexpr")) {
-		x = lval_qexpr();
+	v->cons = NULL;
+	lval_del(v);
+}
+
+// A version of the value that is not shared, with consed cells still shared.
+lval* lval_own(lval* v) {
+	if (!v->cons) {
+		return v;
 	}
 
-	int i;
-	for (i = 0; i < tree->children_num; ++i) {
-		if (!strcmp(tree->children[i]->contents, "(")     ||
-				!strcmp(tree->children[i]->contents, ")") ||
-				!strcmp(tree->children[i]->contents, "{") ||
-				!strcmp(tree->children[i]->contents, "}") ||
-				!strcmp(tree->children[i]->tag, "regex")  ||
-				strstr(tree->children[i]->tag, "comment")) {
-			continue;
+	lval* copy = lval_clone(v);
+	lval_del(v);
+	return copy;
+}
+
+// A version of the value that shares no node at any depth.
+lval* lval_unshare(lval* v) {
+	v = lval_own(v);
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; ++i) {
+			v->cell[i] = lval_unshare(v->cell[i]);
 		}
-		x = lval_add(x, lval_read(tree->children[i]));
 	}
+	return v;
+}
 
-	return x;
+lval* lval_sym(lsym* sym) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_SYM;
+	v->sym = sym;
+	v->slot = -1;
+	return v;
+}
+
+lval* lval_str(char* str) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_STR;
+	v->str = lstr_new(str, strlen(str));
+	return v;
+}
+
+lval* lval_sexpr(void) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_SEXPR;
+	v->count = 0;
+	v->cell = NULL;
+	v->loc.file = NULL;
+	return v;
+}
+
+lval* lval_qexpr(void) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_QEXPR;
+	v->count = 0;
+	v->cell = NULL;
+	v->loc.file = NULL;
+	return v;
+}
+
+lval* lval_fun(lbuiltin func) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_FUN;
+	v->builtin = func;
+	v->memo = NULL;
+	return v;
 }
 
-void lval_print_str(lval* v) {
-	char* escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
-	escaped = mpcf_escape(escaped);
-	printf("\"%s\"", escaped);
-	free(escaped);
+lval* lval_lambda(lval* formals, lval* body) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_FUN;
+
+	v->builtin = NULL;
+	v->memo = NULL;
+	v->lambda = malloc(sizeof(llambda));
+	atomic_init(&v->lambda->refs, 1);
+	v->lambda->formals = formals;
+	v->lambda->body = body;
+	v->lambda->arity = 0;
+	v->lambda->rest = 0;
+	v->lambda->params = malloc(sizeof(lsym*) * formals->count);
+
+	for (int i = 0; i < formals->count; ++i) {
+		if (!strcmp(formals->cell[i]->sym->name, "&")) {
+			v->lambda->rest = 1;
+		} else {
+			v->lambda->params[v->lambda->arity++] = formals->cell[i]->sym;
+		}
+	}
+	v->lambda->arity -= v->lambda->rest;
+
+	for (int i = 0; i < v->lambda->arity + v->lambda->rest; ++i) {
+		atomic_fetch_add_explicit(&v->lambda->params[i]->shadow, 1, memory_order_relaxed);
+	}
+
+	v->lambda->code = NULL;
+	v->lambda->deps = (ldeps) {0, NULL, NULL};
+	v->lambda->body_node = NULL;
+	v->lambda->code_node = NULL;
+
+	atomic_init(&v->lambda->calls, 0);
+	atomic_init(&v->lambda->jit, NULL);
+
+	v->partial = NULL;
+	return v;
+}
+
+void llambda_release(llambda* l) {
+	if (atomic_fetch_sub_explicit(&l->refs, 1, memory_order_acq_rel) == 1) {
+		for (int i = 0; i < l->arity + l->rest; ++i) {
+			atomic_fetch_sub_explicit(&l->params[i]->shadow, 1, memory_order_relaxed);
+		}
+		lval_del(l->formals);
+		lval_del(l->body);
+		free(l->params);
+		if (l->code) {
+			lval_del(l->code);
+		}
+		ldeps_free(&l->deps);
+		if (l->body_node) {
+			lnode_del(l->body_node);
+		}
+		if (l->code_node) {
+			lnode_del(l->code_node);
+		}
+		if (atomic_load_explicit(&l->jit, memory_order_acquire)) {
+			ljit_free(atomic_load_explicit(&l->jit, memory_order_acquire));
+		}
+		free(l);
+	}
+}
+
+void ldeps_add(ldeps* d, lsym* sym) {
+	for (int i = 0; i < d->count; ++i) {
+		if (d->syms[i] == sym) {
+			return;
+		}
+	}
+
+	d->count++;
+	d->syms = realloc(d->syms, sizeof(lsym*) * d->count);
+	d->versions = realloc(d->versions, sizeof(int) * d->count);
+	d->syms[d->count-1] = sym;
+	d->versions[d->count-1] = sym->version;
+}
+
+int ldeps_valid(ldeps* d) {
+	for (int i = 0; i < d->count; ++i) {
+		if (d->syms[i]->version != d->versions[i] ||
+				atomic_load_explicit(&d->syms[i]->shadow, memory_order_relaxed)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void ldeps_free(ldeps* d) {
+	free(d->syms);
+	free(d->versions);
+}
+
+// Builtins whose result depends on nothing but their arguments.
+int lval_pure(lbuiltin func) {
+	return func == builtin_add || func == builtin_sub ||
+		func == builtin_mul || func == builtin_div ||
+		func == builtin_gt || func == builtin_lt ||
+		func == builtin_ge || func == builtin_le ||
+		func == builtin_eq || func == builtin_ne ||
+		func == builtin_list || func == builtin_head ||
+		func == builtin_tail || func == builtin_join;
+}
+
+// Folds an expression in evaluated position. Applications of pure builtins
+// to literals are replaced by their result, unless that is an error, and an
+// 'if' on a literal condition by the branch it takes. Every builtin relied
+// on becomes a dependency of the lambda.
+lval* lval_fold(lenv* e, llambda* l, lval* v) {
+	if (v->type != LVAL_SEXPR) {
+		return v;
+	}
+
+	for (int i = 0; i < v->count; ++i) {
+		v->cell[i] = lval_fold(e, l, v->cell[i]);
+	}
+
+	if (v->count < 2 || v->cell[0]->type != LVAL_SYM) {
+		return v;
+	}
+
+	lsym* op = v->cell[0]->sym;
+	if (!op->global || op->global->type != LVAL_FUN) {
+		return v;
+	}
+
+	if (!op->global->builtin) {
+		lval* x = lval_inline(l, op, v);
+		if (!x) {
+			return v;
+		}
+		lval_del(v);
+		return lval_fold(e, l, x);
+	}
+
+	if (op->global->builtin == builtin_if) {
+		if (v->count != 4 || v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR) {
+			return v;
+		}
+
+		if (v->cell[1]->type == LVAL_NUM) {
+			ldeps_add(&l->deps, op);
+			lval* branch = lval_pop(v, v->cell[1]->num ? 2 : 3);
+			lval_del(v);
+			branch->type = LVAL_SEXPR;
+			return lval_fold(e, l, branch);
+		}
+
+		// The branches are only code as long as this stays the builtin 'if'.
+		int deps = l->deps.count;
+		v->cell[2] = lval_fold_quoted(e, l, v->cell[2]);
+		v->cell[3] = lval_fold_quoted(e, l, v->cell[3]);
+		if (l->deps.count != deps) {
+			ldeps_add(&l->deps, op);
+		}
+		return v;
+	}
+
+	if (!lval_pure(op->global->builtin)) {
+		return v;
+	}
+
+	for (int i = 1; i < v->count; ++i) {
+		int t = v->cell[i]->type;
+		if (t != LVAL_NUM && t != LVAL_STR && t != LVAL_QEXPR) {
+			return v;
+		}
+	}
+
+	lval* args = lval_sexpr();
+	for (int i = 1; i < v->count; ++i) {
+		lval_add(args, lval_copy(v->cell[i]));
+	}
+
+	lval* x = op->global->builtin(e, args);
+	if (x->type == LVAL_ERR) {
+		lval_del(x);
+		return v;
+	}
+
+	ldeps_add(&l->deps, op);
+	lval_del(v);
+	return x;
+}
+
+// Whether the body of a lambda can be substituted into its callers. Once
+// inlined there is no frame for the parameters, so the body may only look
+// up its parameters and call pure builtins, which cannot observe the frame.
+// Counts how often each parameter is used and the size of the body.
+int lval_inlinable(llambda* callee, lval* v, int* uses, int* size) {
+	if (++*size > 16) {
+		return 0;
+	}
+
+	if (v->type == LVAL_SYM) {
+		for (int i = 0; i < callee->arity; ++i) {
+			if (callee->params[i] == v->sym) {
+				uses[i]++;
+				return 1;
+			}
+		}
+
+		lval* global = v->sym->global;
+		return global && global->type == LVAL_FUN && global->builtin &&
+			lval_pure(global->builtin);
+	}
+
+	if (v->type == LVAL_SEXPR) {
+		for (int i = 0; i < v->count; ++i) {
+			if (!lval_inlinable(callee, v->cell[i], uses, size)) {
+				return 0;
+			}
+		}
+	}
+
+	return v->type != LVAL_ERR && v->type != LVAL_FUN && v->type != LVAL_FUT &&
+		v->type != LVAL_SEQ;
+}
+
+// Replaces the parameters of the callee by the arguments of the call, and
+// makes the lambda depend on every builtin the callee's body relies on.
+lval* lval_substitute(llambda* l, llambda* callee, lval* v, lval* call) {
+	if (v->type == LVAL_SYM) {
+		for (int i = 0; i < callee->arity; ++i) {
+			if (callee->params[i] == v->sym) {
+				lval_del(v);
+				return lval_copy(call->cell[i + 1]);
+			}
+		}
+		ldeps_add(&l->deps, v->sym);
+	}
+
+	if (v->type == LVAL_SEXPR) {
+		for (int i = 0; i < v->count; ++i) {
+			v->cell[i] = lval_substitute(l, callee, v->cell[i], call);
+		}
+	}
+
+	return v;
+}
+
+// Inlines a call of a small lambda whose arguments are all literals or
+// symbols, so that evaluating them where the parameters are used neither
+// repeats nor reorders any work. Returns NULL if the call does not qualify.
+lval* lval_inline(llambda* l, lsym* op, lval* call) {
+	lval* func = op->global;
+	llambda* callee = func->lambda;
+
+	if (func->partial || callee->rest || call->count - 1 != callee->arity) {
+		return NULL;
+	}
+
+	lval* body = lval_copy(callee->body);
+	body->type = LVAL_SEXPR;
+
+	int* uses = calloc(callee->arity + 1, sizeof(int));
+	int size = 0;
+	int ok = lval_inlinable(callee, body, uses, &size);
+
+	// A symbol argument must still be looked up, in case it is unbound.
+	for (int i = 0; ok && i < callee->arity; ++i) {
+		int t = call->cell[i + 1]->type;
+		ok = t == LVAL_NUM || t == LVAL_STR || t == LVAL_QEXPR ||
+			(t == LVAL_SYM && uses[i]);
+	}
+	free(uses);
+
+	if (!ok) {
+		lval_del(body);
+		return NULL;
+	}
+
+	ldeps_add(&l->deps, op);
+	return lval_substitute(l, callee, body, call);
+}
+
+// Folds a Q-Expression that will be evaluated as an S-Expression, such as a
+// lambda body or a branch of 'if'.
+lval* lval_fold_quoted(lenv* e, llambda* l, lval* v) {
+	v->type = LVAL_SEXPR;
+	v = lval_fold(e, l, v);
+
+	if (v->type == LVAL_SEXPR) {
+		v->type = LVAL_QEXPR;
+		return v;
+	}
+	return lval_add(lval_qexpr(), v);
+}
+
+void llambda_fold(llambda* l, lenv* e) {
+	l->code = lval_fold_quoted(e, l, lval_copy(l->body));
+
+	if (!l->deps.count) {
+		lval_del(l->code);
+		l->code = NULL;
+	}
+}
+
+// The folded body as long as every builtin it relies on still resolves to
+// the root binding it was folded against, the original body otherwise.
+lval* llambda_code(llambda* l) {
+	return l->code && ldeps_valid(&l->deps) ? l->code : l->body;
+}
+
+// Takes over the arguments, which bind the formals following the ones
+// bound by 'prev'.
+lpartial* lpartial_new(lpartial* prev, lval* args) {
+	lpartial* p = malloc(sizeof(lpartial) + sizeof(lval*) * args->count);
+	atomic_init(&p->refs, 1);
+	p->prev = prev;
+	p->bound = (prev ? prev->bound : 0) + args->count;
+	p->count = args->count;
+
+	if (prev) {
+		atomic_fetch_add_explicit(&prev->refs, 1, memory_order_relaxed);
+	}
+
+	for (int i = 0; i < args->count; ++i) {
+		p->args[i] = args->cell[i];
+	}
+
+	args->count = 0;
+	lval_del(args);
+	return p;
+}
+
+void lpartial_bind(lpartial* p, lenv* frame) {
+	if (p->prev) {
+		lpartial_bind(p->prev, frame);
+	}
+
+	for (int i = 0, first = p->bound - p->count; i < p->count; ++i) {
+		frame->vals[first + i] = lval_copy(p->args[i]);
+	}
+}
+
+void lpartial_release(lpartial* p) {
+	while (p && atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) == 1) {
+		lpartial* prev = p->prev;
+		for (int i = 0; i < p->count; ++i) {
+			lval_del(p->args[i]);
+		}
+		free(p);
+		p = prev;
+	}
+}
+
+/* Closure compilation of lambda bodies */
+
+lnode* lnode_new(leval eval) {
+	lnode* n = calloc(1, sizeof(lnode));
+	n->eval = eval;
+	return n;
+}
+
+// Compiles an expression in evaluated position.
+lnode* lnode_compile(lval* v) {
+	if (v->type == LVAL_SYM) {
+		lnode* n = lnode_new(lnode_sym);
+		n->val = lval_copy(v);
+		return n;
+	}
+
+	if (v->type != LVAL_SEXPR) {
+		lnode* n = lnode_new(lnode_const);
+		n->val = lval_copy(v);
+		return n;
+	}
+
+	lnode* n = lnode_new(lnode_sexpr);
+	n->loc = v->loc;
+	n->count = v->count;
+	n->nodes = malloc(sizeof(lnode*) * v->count);
+	for (int i = 0; i < v->count; ++i) {
+		n->nodes[i] = lnode_compile(v->cell[i]);
+	}
+
+	// A builtin in the first cell is called directly for as long as nothing
+	// rebinds or shadows its symbol.
+	if (v->count < 2 || v->cell[0]->type != LVAL_SYM) {
+		return n;
+	}
+
+	lsym* op = v->cell[0]->sym;
+	if (!op->global || op->global->type != LVAL_FUN || !op->global->builtin || op->global->memo) {
+		return n;
+	}
+
+	n->op = op;
+	n->version = op->version;
+	n->builtin = op->global->builtin;
+	n->eval = lnode_builtin;
+
+	if (n->builtin == builtin_if && v->count == 4 &&
+			v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+		n->then = lnode_branch(v->cell[2]);
+		n->other = lnode_branch(v->cell[3]);
+		n->eval = lnode_if;
+	}
+
+	return n;
+}
+
+// Compiles a Q-Expression that gets evaluated as an S-Expression.
+lnode* lnode_branch(lval* v) {
+	v->type = LVAL_SEXPR;
+	lnode* n = lnode_compile(v);
+	v->type = LVAL_QEXPR;
+	return n;
+}
+
+void lnode_del(lnode* n) {
+	if (n->val) {
+		lval_del(n->val);
+	}
+	for (int i = 0; i < n->count; ++i) {
+		lnode_del(n->nodes[i]);
+	}
+	free(n->nodes);
+	if (n->then) {
+		lnode_del(n->then);
+		lnode_del(n->other);
+	}
+	free(n);
+}
+
+lval* lnode_const(lenv* e, lnode* n) {
+	return lval_copy(n->val);
+}
+
+lval* lnode_sym(lenv* e, lnode* n) {
+	return lenv_get(e, n->val);
+}
+
+lval* lnode_sexpr(lenv* e, lnode* n) {
+	lval* v = lval_sexpr();
+	v->count = n->count;
+	v->cell = malloc(sizeof(lval*) * n->count);
+
+	for (int i = 0; i < n->count; ++i) {
+		lval* x = n->nodes[i]->eval(e, n->nodes[i]);
+		if (x->type == LVAL_ERR) {
+			v->count = i;
+			lval_del(v);
+			return ltrail_add(x, &n->loc);
+		}
+		v->cell[i] = x;
+	}
+
+	return ltrail_add(lval_invoke(e, v), &n->loc);
+}
+
+lval* lnode_builtin(lenv* e, lnode* n) {
+	if (n->op->version != n->version ||
+			atomic_load_explicit(&n->op->shadow, memory_order_relaxed)) {
+		return lnode_sexpr(e, n);
+	}
+
+	lval* args = lval_sexpr();
+	args->count = n->count - 1;
+	args->cell = malloc(sizeof(lval*) * args->count);
+
+	for (int i = 1; i < n->count; ++i) {
+		lval* x = n->nodes[i]->eval(e, n->nodes[i]);
+		if (x->type == LVAL_ERR) {
+			args->count = i - 1;
+			lval_del(args);
+			return ltrail_add(x, &n->loc);
+		}
+		args->cell[i - 1] = x;
+	}
+
+	return ltrail_add(n->builtin(e, args), &n->loc);
+}
+
+// Only the branch taken is ever built, and only if the condition is a
+// number. Anything else goes to the builtin for the error.
+lval* lnode_if(lenv* e, lnode* n) {
+	if (n->op->version != n->version ||
+			atomic_load_explicit(&n->op->shadow, memory_order_relaxed)) {
+		return lnode_sexpr(e, n);
+	}
+
+	lval* cond = n->nodes[1]->eval(e, n->nodes[1]);
+	if (cond->type == LVAL_ERR) {
+		return ltrail_add(cond, &n->loc);
+	}
+
+	if (cond->type != LVAL_NUM) {
+		lval* args = lval_add(lval_sexpr(), cond);
+		lval_add(args, lval_copy(n->nodes[2]->val));
+		lval_add(args, lval_copy(n->nodes[3]->val));
+		return ltrail_add(builtin_if(e, args), &n->loc);
+	}
+
+	lnode* branch = cond->num ? n->then : n->other;
+	lval_del(cond);
+	return ltrail_add(branch->eval(e, branch), &n->loc);
+}
+
+// Evaluates the body of a lambda in its call frame.
+lval* llambda_eval(llambda* l, lenv* frame) {
+	lval* code = llambda_code(l);
+
+	if (l->body_node) {
+		lnode* n = code == l->code ? l->code_node : l->body_node;
+		return n->eval(frame, n);
+	}
+	return builtin_eval(frame, lval_add(lval_sexpr(), lval_copy(code)));
+}
+
+/* Template JIT for numeric lambdas */
+
+// Lambdas whose body only does arithmetic and comparisons on its parameters
+// and number literals, branches with 'if', and calls other such lambdas
+// have no side effects. Their bodies are compiled to x86-64 code working on
+// plain longs. Whenever a value is not a number, a division is by zero or a
+// callee does not qualify, the code gives up and the call is interpreted
+// from the start, which reproduces the exact error.
+//
+// Compiled callees run straight from compiled code, so giving up unwinds
+// the whole chain of compiled calls to the nearest interpreted one. That
+// call then interprets everything beneath it as well, instead of retrying
+// code that already gave up at every level of a recursion.
+
+// Set while a call whose compiled code gave up is interpreted.
+_Thread_local int ljit_fallback = 0;
+
+typedef struct {
+	unsigned char* code;
+	int count;
+	int size;
+
+	/* Slots pushed on the machine stack since the prologue */
+	int depth;
+
+	/* Offsets of jumps to the code that gives up */
+	int* faults;
+	int nfaults;
+
+	llambda* l;
+	ldeps deps;
+} lasm;
+
+void lasm_bytes(lasm* a, const char* bytes, int n) {
+	if (a->count + n > a->size) {
+		a->size = (a->count + n) * 2;
+		a->code = realloc(a->code, a->size);
+	}
+	memcpy(a->code + a->count, bytes, n);
+	a->count += n;
+}
+
+void lasm_int(lasm* a, int v) {
+	lasm_bytes(a, (char*) &v, 4);
+}
+
+void lasm_long(lasm* a, long v) {
+	lasm_bytes(a, (char*) &v, 8);
+}
+
+// Emits a jump with a 32-bit displacement to be patched later, returning
+// the position of the displacement.
+int lasm_jump(lasm* a, const char* op, int n) {
+	lasm_bytes(a, op, n);
+	lasm_int(a, 0);
+	return a->count - 4;
+}
+
+void lasm_patch(lasm* a, int at) {
+	int rel = a->count - (at + 4);
+	memcpy(a->code + at, &rel, 4);
+}
+
+void lasm_fault(lasm* a, const char* op, int n) {
+	a->faults = realloc(a->faults, sizeof(int) * (a->nfaults + 1));
+	a->faults[a->nfaults++] = lasm_jump(a, op, n);
+}
+
+void lasm_push(lasm* a) {
+	lasm_bytes(a, "\x50", 1);                      /* push rax */
+	a->depth++;
+}
+
+void lasm_pop(lasm* a) {
+	lasm_bytes(a, "\x59", 1);                      /* pop rcx */
+	a->depth--;
+}
+
+int ljit_expr(lasm* a, lval* v);
+
+int ljit_body(lasm* a, lval* v);
+
+int ljit_apply(lasm* a, lval* v);
+
+// Leaves the value of the expression in rax.
+int ljit_expr(lasm* a, lval* v) {
+	if (v->type == LVAL_NUM) {
+		lasm_bytes(a, "\x48\xB8", 2);              /* mov rax, imm64 */
+		lasm_long(a, v->num);
+		return 1;
+	}
+
+	if (v->type == LVAL_SYM) {
+		for (int i = 0; i < a->l->arity; ++i) {
+			if (a->l->params[i] == v->sym) {
+				lasm_bytes(a, "\x48\x8B\x8B", 3);  /* mov rcx, [rbx + vals] */
+				lasm_int(a, offsetof(lenv, vals));
+				lasm_bytes(a, "\x48\x8B\x89", 3);  /* mov rcx, [rcx + 8 * i] */
+				lasm_int(a, 8 * i);
+				lasm_bytes(a, "\x81\xB9", 2);      /* cmp dword [rcx + type], LVAL_NUM */
+				lasm_int(a, offsetof(lval, type));
+				lasm_int(a, LVAL_NUM);
+				lasm_fault(a, "\x0F\x85", 2);      /* jne fault */
+				lasm_bytes(a, "\x48\x8B\x81", 3);  /* mov rax, [rcx + num] */
+				lasm_int(a, offsetof(lval, num));
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	if (v->type == LVAL_SEXPR) {
+		return ljit_body(a, v);
+	}
+
+	return 0;
+}
+
+// Compiles the cells of an expression, which may also be a Q-Expression
+// that gets evaluated, like the body or a branch of 'if'.
+int ljit_body(lasm* a, lval* v) {
+	if (v->count == 1) {
+		return ljit_expr(a, v->cell[0]);
+	}
+	return v->count > 1 && ljit_apply(a, v);
+}
+
+int ljit_apply(lasm* a, lval* v) {
+	if (v->cell[0]->type != LVAL_SYM) {
+		return 0;
+	}
+
+	lsym* op = v->cell[0]->sym;
+	for (int i = 0; i < a->l->arity + a->l->rest; ++i) {
+		if (a->l->params[i] == op) {
+			return 0;
+		}
+	}
+
+	lbuiltin f = op->global && op->global->type == LVAL_FUN ? op->global->builtin : NULL;
+	int argc = v->count - 1;
+
+	// Anything but a builtin is called through the runtime, which checks
+	// that the function it finds qualifies as well.
+	if (!f) {
+		if (op->global && op->global->type != LVAL_FUN) {
+			return 0;
+		}
+
+		int pad = (a->depth + argc) & 1;
+		if (pad) {
+			lasm_bytes(a, "\x48\x83\xEC\x08", 4);  /* sub rsp, 8 */
+			a->depth++;
+		}
+		for (int i = 1; i < v->count; ++i) {
+			if (!ljit_expr(a, v->cell[i])) {
+				return 0;
+			}
+			lasm_push(a);
+		}
+
+		lasm_bytes(a, "\x48\x89\xDF", 3);          /* mov rdi, rbx */
+		lasm_bytes(a, "\x48\xBE", 2);              /* mov rsi, imm64 */
+		lasm_long(a, (long) v->cell[0]);
+		lasm_bytes(a, "\x48\x89\xE2", 3);          /* mov rdx, rsp */
+		lasm_bytes(a, "\xB9", 1);                  /* mov ecx, imm32 */
+		lasm_int(a, argc);
+		lasm_bytes(a, "\x4D\x89\xE0", 3);          /* mov r8, r12 */
+		lasm_bytes(a, "\x48\xB8", 2);              /* mov rax, imm64 */
+		lasm_long(a, (long) ljit_call);
+		lasm_bytes(a, "\xFF\xD0", 2);              /* call rax */
+		lasm_bytes(a, "\x48\x81\xC4", 3);          /* add rsp, imm32 */
+		lasm_int(a, 8 * (argc + pad));
+		a->depth -= argc + pad;
+		lasm_bytes(a, "\x85\xC0", 2);              /* test eax, eax */
+		lasm_fault(a, "\x0F\x84", 2);              /* je fault */
+		lasm_bytes(a, "\x49\x8B\x04\x24", 4);      /* mov rax, [r12] */
+		return 1;
+	}
+
+	ldeps_add(&a->deps, op);
+
+	if (f == builtin_if) {
+		if (argc != 3 || v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR ||
+				!ljit_expr(a, v->cell[1])) {
+			return 0;
+		}
+
+		lasm_bytes(a, "\x48\x85\xC0", 3);          /* test rax, rax */
+		int other = lasm_jump(a, "\x0F\x84", 2);   /* je other */
+		if (!ljit_body(a, v->cell[2])) {
+			return 0;
+		}
+		int end = lasm_jump(a, "\xE9", 1);         /* jmp end */
+		lasm_patch(a, other);
+		if (!ljit_body(a, v->cell[3])) {
+			return 0;
+		}
+		lasm_patch(a, end);
+		return 1;
+	}
+
+	if (f == builtin_add || f == builtin_sub || f == builtin_mul || f == builtin_div) {
+		if (!ljit_expr(a, v->cell[1])) {
+			return 0;
+		}
+		if (f == builtin_sub && argc == 1) {
+			lasm_bytes(a, "\x48\xF7\xD8", 3);      /* neg rax */
+		}
+
+		for (int i = 2; i < v->count; ++i) {
+			lasm_push(a);
+			if (!ljit_expr(a, v->cell[i])) {
+				return 0;
+			}
+			lasm_bytes(a, "\x48\x89\xC1", 3);      /* mov rcx, rax */
+			lasm_bytes(a, "\x58", 1);              /* pop rax */
+			a->depth--;
+
+			if (f == builtin_add) {
+				lasm_bytes(a, "\x48\x01\xC8", 3);  /* add rax, rcx */
+			} else if (f == builtin_sub) {
+				lasm_bytes(a, "\x48\x29\xC8", 3);  /* sub rax, rcx */
+			} else if (f == builtin_mul) {
+				lasm_bytes(a, "\x48\x0F\xAF\xC1", 4);  /* imul rax, rcx */
+			} else {
+				lasm_bytes(a, "\x48\x85\xC9", 3);  /* test rcx, rcx */
+				lasm_fault(a, "\x0F\x84", 2);      /* je fault */
+				lasm_bytes(a, "\x48\x99", 2);      /* cqo */
+				lasm_bytes(a, "\x48\xF7\xF9", 3);  /* idiv rcx */
+			}
+		}
+		return 1;
+	}
+
+	const char* set = NULL;
+	if (f == builtin_gt) { set = "\x0F\x9F\xC0"; }   /* setg al */
+	if (f == builtin_lt) { set = "\x0F\x9C\xC0"; }   /* setl al */
+	if (f == builtin_ge) { set = "\x0F\x9D\xC0"; }   /* setge al */
+	if (f == builtin_le) { set = "\x0F\x9E\xC0"; }   /* setle al */
+	if (f == builtin_eq) { set = "\x0F\x94\xC0"; }   /* sete al */
+	if (f == builtin_ne) { set = "\x0F\x95\xC0"; }   /* setne al */
+
+	if (!set || argc != 2 || !ljit_expr(a, v->cell[1])) {
+		return 0;
+	}
+	lasm_push(a);
+	if (!ljit_expr(a, v->cell[2])) {
+		return 0;
+	}
+	lasm_bytes(a, "\x48\x89\xC1", 3);              /* mov rcx, rax */
+	lasm_bytes(a, "\x58", 1);                      /* pop rax */
+	a->depth--;
+	lasm_bytes(a, "\x48\x39\xC8", 3);              /* cmp rax, rcx */
+	lasm_bytes(a, set, 3);
+	lasm_bytes(a, "\x0F\xB6\xC0", 3);              /* movzx eax, al */
+	return 1;
+}
+
+// Called from compiled code for anything that is not a builtin. The
+// arguments are on the machine stack, the last one first.
+int ljit_call(lenv* frame, lval* sym, long* argv, int argc, long* out) {
+	lval* f = lenv_get(frame, sym);
+
+	int ok = f->type == LVAL_FUN && !f->builtin && !f->partial &&
+		!f->lambda->rest && f->lambda->arity == argc;
+
+	// Only callees that compile are known to be free of side effects.
+	ljit_fn fn = NULL;
+	if (ok) {
+		ljit* j = atomic_load_explicit(&f->lambda->jit, memory_order_acquire);
+		if (!j) {
+			j = ljit_install(f->lambda, frame);
+		}
+		fn = j->fn && ldeps_valid(&j->deps) ? j->fn : NULL;
+	}
+
+	if (!fn) {
+		lval_del(f);
+		return 0;
+	}
+
+	lenv* callee = lenv_frame(frame, f->lambda);
+	for (int i = 0; i < argc; ++i) {
+		callee->vals[i] = lval_num(argv[argc - 1 - i]);
+	}
+
+	ok = fn(callee, out);
+
+	lenv_del(callee);
+	lval_del(f);
+	return ok;
+}
+
+ljit* ljit_compile(llambda* l) {
+	ljit* j = calloc(1, sizeof(ljit));
+
+#if defined(__x86_64__)
+	lasm a = {NULL, 0, 0, 0, NULL, 0, l, {0, NULL, NULL}};
+
+	lasm_bytes(&a, "\x55", 1);                     /* push rbp */
+	lasm_bytes(&a, "\x48\x89\xE5", 3);             /* mov rbp, rsp */
+	lasm_bytes(&a, "\x53", 1);                     /* push rbx */
+	lasm_bytes(&a, "\x41\x54", 2);                 /* push r12 */
+	lasm_bytes(&a, "\x48\x89\xFB", 3);             /* mov rbx, rdi */
+	lasm_bytes(&a, "\x49\x89\xF4", 3);             /* mov r12, rsi */
+
+	int ok = ljit_body(&a, l->body);
+
+	lasm_bytes(&a, "\x49\x89\x04\x24", 4);         /* mov [r12], rax */
+	lasm_bytes(&a, "\xB8\x01\x00\x00\x00", 5);     /* mov eax, 1 */
+	int done = lasm_jump(&a, "\xE9", 1);           /* jmp done */
+
+	for (int i = 0; i < a.nfaults; ++i) {
+		lasm_patch(&a, a.faults[i]);
+	}
+	lasm_bytes(&a, "\x31\xC0", 2);                 /* xor eax, eax */
+
+	lasm_patch(&a, done);
+	lasm_bytes(&a, "\x48\x8D\x65\xF0", 4);         /* lea rsp, [rbp - 16] */
+	lasm_bytes(&a, "\x41\x5C", 2);                 /* pop r12 */
+	lasm_bytes(&a, "\x5B", 1);                     /* pop rbx */
+	lasm_bytes(&a, "\x5D", 1);                     /* pop rbp */
+	lasm_bytes(&a, "\xC3", 1);                     /* ret */
+
+	if (ok) {
+		long page = sysconf(_SC_PAGESIZE);
+		j->size = (a.count + page - 1) / page * page;
+		void* code = mmap(NULL, j->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (code != MAP_FAILED) {
+			memcpy(code, a.code, a.count);
+
+			// Systems that refuse executable mappings keep the lambda interpreted.
+			if (mprotect(code, j->size, PROT_READ | PROT_EXEC)) {
+				munmap(code, j->size);
+				code = MAP_FAILED;
+			}
+		}
+
+		if (code != MAP_FAILED) {
+			j->fn = (ljit_fn) code;
+			j->deps = a.deps;
+			a.deps = (ldeps) {0, NULL, NULL};
+
+			// Lets perf attribute samples in the code to the lambda.
+			static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+			char path[64];
+			snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+			char* formals = lval_to_string(l->formals);
+
+			pthread_mutex_lock(&perf_lock);
+			FILE* f = fopen(path, "a");
+			if (f) {
+				fprintf(f, "%lx %x lispora:(\\ %s)\n", (unsigned long) code, a.count, formals);
+				fclose(f);
+			}
+			pthread_mutex_unlock(&perf_lock);
+			free(formals);
+		}
+	}
+
+	ldeps_free(&a.deps);
+	free(a.faults);
+	free(a.code);
+#endif
+
+	return j;
+}
+
+// Compiles the lambda, unless the interpreter has compilation turned off,
+// and publishes the result. Whoever gets there first wins.
+ljit* ljit_install(llambda* l, lenv* e) {
+	ljit* j = lenv_interp(e)->jit ? ljit_compile(l) : calloc(1, sizeof(ljit));
+
+	ljit* expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&l->jit, &expected, j,
+				memory_order_acq_rel, memory_order_acquire)) {
+		ljit_free(j);
+		j = expected;
+	}
+	return j;
+}
+
+void ljit_free(ljit* j) {
+	if (j->fn) {
+		munmap((void*) j->fn, j->size);
+	}
+	ldeps_free(&j->deps);
+	free(j);
+}
+
+// The machine code to run for a call, if any. Counts calls until the
+// lambda is hot enough to be compiled.
+ljit_fn ljit_code(llambda* l, lenv* e) {
+	ljit* j = atomic_load_explicit(&l->jit, memory_order_acquire);
+
+	if (!j) {
+		if (atomic_fetch_add_explicit(&l->calls, 1, memory_order_relaxed) != LJIT_THRESHOLD) {
+			return NULL;
+		}
+		j = ljit_install(l, e);
+	}
+
+	return j->fn && ldeps_valid(&j->deps) ? j->fn : NULL;
+}
+
+// Records in every reference to a formal which slot of the call frame it will
+// be bound to. Frames are filled in the order of the formals, skipping '&'.
+void lval_address(lval* v, lval* formals) {
+	if (v->type == LVAL_SYM) {
+		v->slot = -1;
+		for (int i = 0, slot = 0; i < formals->count; ++i) {
+			if (!strcmp(formals->cell[i]->sym->name, "&")) {
+				continue;
+			}
+			if (formals->cell[i]->sym == v->sym) {
+				v->slot = slot;
+				break;
+			}
+			slot++;
+		}
+	}
+
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; ++i) {
+			lval_address(v->cell[i], formals);
+		}
+	}
+}
+
+lval* lval_fut(ltask* task) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_FUT;
+	v->task = task;
+	return v;
+}
+
+void lval_del(lval* v) {
+	if (v->cons) {
+		lcons_release(v);
+		return;
+	}
+
+	if (v->type == LVAL_ERR) {
+		if (atomic_load_explicit(&v->refs, memory_order_relaxed) >= 0 &&
+				atomic_fetch_sub_explicit(&v->refs, 1, memory_order_acq_rel) == 1) {
+			free(atomic_load_explicit(&v->err->msg, memory_order_relaxed));
+			free(v);
+		}
+		return;
+	}
+
+	switch (v->type) {
+		case LVAL_NUM:
+			break;
+		case LVAL_SYM:
+			break;
+		case LVAL_STR:
+			lstr_release(v->str);
+			break;
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			for (int i = 0; i < v->count; ++i) {
+				lval_del(v->cell[i]);
+			}
+
+			free(v->cell);
+			break;
+		case LVAL_FUN:
+			if (!v->builtin) {
+				llambda_release(v->lambda);
+				lpartial_release(v->partial);
+			} else if (v->memo) {
+				lmemo_release(v->memo);
+			}
+			break;
+		case LVAL_FUT:
+			ltask_release(v->task);
+			break;
+		case LVAL_SEQ:
+			lseq_release(v->seq);
+			break;
+	}
+
+	free(v);
+}
+
+lval* lval_copy(lval* v) {
+	if (v->type == LVAL_ERR) {
+		if (atomic_load_explicit(&v->refs, memory_order_relaxed) >= 0) {
+			atomic_fetch_add_explicit(&v->refs, 1, memory_order_relaxed);
+		}
+		return v;
+	}
+	if (v->cons) {
+		atomic_fetch_add_explicit(&v->refs, 1, memory_order_relaxed);
+		return v;
+	}
+	return lval_clone(v);
+}
+
+// Copies the value itself even if it is hash-consed. Cells are still copied
+// with lval_copy, so consed ones are shared.
+lval* lval_clone(lval* v) {
+	lval* copy = malloc(sizeof(lval));
+	copy->type = v->type;
+	copy->cons = NULL;
+
+	switch (v->type) {
+		case LVAL_FUN:
+			copy->memo = v->memo;
+			if (v->builtin) {
+				copy->builtin = v->builtin;
+				if (copy->memo) {
+					atomic_fetch_add_explicit(&copy->memo->refs, 1, memory_order_relaxed);
+				}
+			} else {
+				copy->builtin = NULL;
+				copy->lambda = v->lambda;
+				copy->partial = v->partial;
+				atomic_fetch_add_explicit(&copy->lambda->refs, 1, memory_order_relaxed);
+				if (copy->partial) {
+					atomic_fetch_add_explicit(&copy->partial->refs, 1, memory_order_relaxed);
+				}
+			}
+			break;
+		case LVAL_NUM:
+			copy->num = v->num;
+			break;
+		case LVAL_ERR:
+			free(copy);
+			return lval_copy(v);
+		case LVAL_SYM:
+			copy->sym = v->sym;
+			copy->slot = v->slot;
+			break;
+		case LVAL_STR:
+			copy->str = lstr_ref(v->str);
+			break;
+
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			copy->loc = v->loc;
+			copy->count = v->count;
+			copy->cell = malloc(sizeof(lval*) * copy->count);
+			for (int i = 0; i < copy->count; ++i) {
+				copy->cell[i] = lval_copy(v->cell[i]);
+			}
+			break;
+		case LVAL_FUT:
+			copy->task = v->task;
+			atomic_fetch_add(&copy->task->refs, 1);
+			break;
+		case LVAL_SEQ:
+			copy->seq = lseq_ref(v->seq);
+			break;
+	}
+
+	return copy;
+}
+
+lval* lval_add(lval* v, lval* x) {
+	v->count++;
+	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	v->cell[v->count-1] = x;
+	return v;
+}
+
+lval* lval_read_num(mpc_ast_t* tree) {
+	errno = 0;
+	long x = strtol(tree->contents, NULL, 10);
+	if (errno != ERANGE) {
+		return lval_num(x);
+	} else {
+		return lval_err("Invalid number");
+	}
+}
+
+lval* lval_read_str(mpc_ast_t* tree) {
+	tree->contents[strlen(tree->contents)-1] = '\0';
+	char* unescaped = malloc(strlen(tree->contents+1)+1);
+
+	strcpy(unescaped, tree->contents+1);
+	unescaped = mpcf_unescape(unescaped);
+
+	lval* str = lval_str(unescaped);
+	free(unescaped);
+	return str;
+}
+
+lval* lval_read(lsymtab* syms, lsym* file, mpc_ast_t* tree) {
+	if (strstr(tree->tag, "number")) {
+		return lval_read_num(tree);
+	}
+
+	if (strstr(tree->tag, "symbol")) {
+		return lval_sym(lsym_intern(syms, tree->contents));
+	}
+
+	if (strstr(tree->tag, "string")) {
+		return lval_read_str(tree);
+	}
+
+	lval* x = NULL;
+	if ((!strcmp(tree->tag, ">")) || strstr(tree->tag, "sexpr")) {
+		x = lval_sexpr();
+	}
+
+	int quoted = 0;
+	if (strstr(tree->tag, "qexpr")) {
+		x = lval_qexpr();
+		quoted = 1;
+	}
+
+	x->loc.file = file;
+	x->loc.row = tree->state.row + 1;
+	x->loc.col = tree->state.col + 1;
+
+	int i;
+	for (i = 0; i < tree->children_num; ++i) {
+		if (!strcmp(tree->children[i]->contents, "(")     ||
+				!strcmp(tree->children[i]->contents, ")") ||
+				!strcmp(tree->children[i]->contents, "{") ||
+				!strcmp(tree->children[i]->contents, "}") ||
+				!strcmp(tree->children[i]->tag, "regex")  ||
+				strstr(tree->children[i]->tag, "comment")) {
+			continue;
+		}
+		x = lval_add(x, lval_read(syms, file, tree->children[i]));
+	}
+
+	return quoted ? lval_intern(syms->cons, x) : x;
+}
+
+void lbuf_init(lbuf* b, FILE* file) {
+	b->file = file;
+	b->len = 0;
+	b->cap = file ? LBUF_SIZE : 64;
+	b->data = malloc(b->cap);
+}
+
+void lbuf_free(lbuf* b) {
+	free(b->data);
+}
+
+void lbuf_drain(lbuf* b) {
+	if (b->file && b->len) {
+		fwrite(b->data, 1, b->len, b->file);
+	}
+	b->len = 0;
+}
+
+void lbuf_put(lbuf* b, const char* str, size_t len) {
+	if (b->len + len > b->cap) {
+		if (b->file) {
+			lbuf_drain(b);
+			if (len > b->cap) {
+				fwrite(str, 1, len, b->file);
+				return;
+			}
+		} else {
+			while (b->len + len > b->cap) {
+				b->cap *= 2;
+			}
+			b->data = realloc(b->data, b->cap);
+		}
+	}
+
+	memcpy(b->data + b->len, str, len);
+	b->len += len;
+}
+
+void lbuf_puts(lbuf* b, const char* str) {
+	lbuf_put(b, str, strlen(str));
+}
+
+void lbuf_putc(lbuf* b, char c) {
+	if (b->len == b->cap) {
+		lbuf_put(b, &c, 1);
+	} else {
+		b->data[b->len++] = c;
+	}
+}
+
+void lbuf_num(lbuf* b, long num) {
+	char digits[24];
+	char* p = digits + sizeof(digits);
+	unsigned long n = num < 0 ? -(unsigned long) num : (unsigned long) num;
+
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	if (num < 0) {
+		*--p = '-';
+	}
+
+	lbuf_put(b, p, digits + sizeof(digits) - p);
+}
+
+// Writes the characters of a string, escaped the way the reader expects
+// them if asked to. Ropes are written leaf by leaf without flattening.
+void lbuf_chars(lbuf* b, lstr* s, int escape) {
+	char* flat = atomic_load_explicit(&s->flat, memory_order_acquire);
+	if (!flat) {
+		lbuf_chars(b, s->left, escape);
+		lbuf_chars(b, s->right, escape);
+		return;
+	}
+
+	if (!escape) {
+		lbuf_put(b, flat, s->len);
+		return;
+	}
+
+	char* run = flat;
+	char* end = flat + s->len;
+	for (char* p = flat; p < end; ++p) {
+		char c;
+		switch (*p) {
+			case '\a': c = 'a'; break;
+			case '\b': c = 'b'; break;
+			case '\f': c = 'f'; break;
+			case '\n': c = 'n'; break;
+			case '\r': c = 'r'; break;
+			case '\t': c = 't'; break;
+			case '\v': c = 'v'; break;
+			case '\\': c = '\\'; break;
+			case '\'': c = '\''; break;
+			case '\"': c = '\"'; break;
+			case '\0': c = '0'; break;
+			default: continue;
+		}
+
+		lbuf_put(b, run, p - run);
+		lbuf_putc(b, '\\');
+		lbuf_putc(b, c);
+		run = p + 1;
+	}
+	lbuf_put(b, run, end - run);
+}
+
+void lval_print_str(lbuf* b, lval* v) {
+	lbuf_putc(b, '"');
+	lbuf_chars(b, v->str, 1);
+	lbuf_putc(b, '"');
+}
+
+void lval_expr_print(lbuf* b, lval* v, char open, char close) {
+	lbuf_putc(b, open);
+
+	int i;
+	for (i = 0; i < v->count; ++i) {
+		lval_print(b, v->cell[i]);
+		if (i != v->count-1) {
+			lbuf_putc(b, ' ');
+		}
+	}
+	lbuf_putc(b, close);
+}
+
+void lval_print(lbuf* b, lval* v) {
+	switch (v->type) {
+		case LVAL_NUM:
+			lbuf_num(b, v->num);
+			break;
+		case LVAL_ERR:
+			lbuf_puts(b, "Error: ");
+			lbuf_puts(b, lerr_message(v->err));
+			break;
+		case LVAL_SYM:
+			lbuf_puts(b, v->sym->name);
+			break;
+		case LVAL_STR:
+			lval_print_str(b, v);
+			break;
+		case LVAL_SEXPR:
+			lval_expr_print(b, v, '(', ')');
+			break;
+		case LVAL_QEXPR:
+			lval_expr_print(b, v, '{', '}');
+			break;
+		case LVAL_FUN:
+			if (v->builtin) {
+				lbuf_puts(b, "<function>");
+			} else {
+				lval* formals = v->lambda->formals;
+				int bound = v->partial ? v->partial->bound : 0;
+
+				lbuf_puts(b, "(\\ {");
+				for (int i = bound; i < formals->count; ++i) {
+					lval_print(b, formals->cell[i]);
+					if (i != formals->count - 1) {
+						lbuf_putc(b, ' ');
+					}
+				}
+				lbuf_puts(b, "} ");
+				lval_print(b, v->lambda->body);
+				lbuf_putc(b, ')');
+			}
+			break;
+		case LVAL_FUT:
+			lbuf_puts(b, "<future>");
+			break;
+		case LVAL_SEQ:
+			lbuf_puts(b, "<sequence>");
+			break;
+	}
+}
+
+void lval_println(lbuf* b, lval* v) {
+	lval_print(b, v);
+	lbuf_putc(b, '\n');
+}
+
+char* lval_to_string(lval* v) {
+	lbuf b;
+	lbuf_init(&b, NULL);
+	lval_print(&b, v);
+	lbuf_putc(&b, '\0');
+	return b.data;
+}
+
+// The printed form of a value, with the trail if it is an error.
+char* lval_report(lval* x) {
+	lbuf b;
+	lbuf_init(&b, NULL);
+	lval_print(&b, x);
+	if (x->type == LVAL_ERR) {
+		ltrail_print(&b, x);
+	}
+	lbuf_putc(&b, '\0');
+	return b.data;
+}
+
+// Cells taken out of an expression are the caller's to change, so a
+// hash-consed one is swapped for a copy of its own.
+lval* lval_pop(lval* v, int i) {
+	lval* item = v->cell[i];
+	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i - 1));
+	v->count--;
+	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+
+	return lval_own(item);
+}
+
+lval* lval_take(lval* v, int i) {
+	lval* item = lval_pop(v, i);
+	lval_del(v);
+	return item;
+}
+
+// Cells after the first one that fails are dropped without being evaluated.
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+	lloc loc = v->loc;
+
+	for (int i = 0; i < v->count; ++i) {
+		v->cell[i] = lval_eval(e, v->cell[i]);
+		if (v->cell[i]->type == LVAL_ERR) {
+			return ltrail_add(lval_take(v, i), &loc);
+		}
+	}
+
+	return ltrail_add(lval_invoke(e, v), &loc);
+}
+
+// Applies an S-Expression whose cells have been evaluated without error.
+lval* lval_invoke(lenv* e, lval* v) {
+	if (v->count == 0) {
+		return v;
+	}
+
+	if (v->count == 1) {
+		return lval_take(v, 0);
+	}
+
+	lval* first = lval_pop(v, 0);
+	if (first->type != LVAL_FUN) {
+		lval* err = lval_err(
+				"S-Expression starts with incorrect type. Got %s, expected %s.",
+				ltype_name(first->type), ltype_name(LVAL_FUN));
+		lval_del(v);
+		lval_del(first);
+		return err;
+	}
+
+	lval* result = lval_call(e, first, v);
+	lval_del(first);
+	return result;
+}
+
+lval* lval_call(lenv* e, lval* func, lval* args) {
+	if (func->memo) {
+		return lmemo_call(e, func->memo, args);
+	}
+
+	if (func->builtin) {
+		return func->builtin(e, args);
+	}
+
+	llambda* l = func->lambda;
+	int bound = func->partial ? func->partial->bound : 0;
+	int given = args->count;
+
+	// Too few arguments just adds another link to the partial application,
+	// without evaluating or copying anything.
+	if (bound + given < l->arity) {
+		if (given == 0) {
+			lval_del(args);
+			return lval_copy(func);
+		}
+
+		lval* partial = lval_copy(func);
+		partial->partial = lpartial_new(func->partial, args);
+		lpartial_release(func->partial);
+		return partial;
+	}
+
+	if (bound + given > l->arity && !l->rest) {
+		lval_del(args);
+		return lval_err("Function passed too amny arguments. Got %i, expected %i.",
+				given, l->arity - bound);
+	}
+
+	// The function itself is never modified, arguments are moved into a
+	// frame of the call's own, after whatever partial application bound.
+	lenv* frame = lenv_frame(e, l);
+
+	if (func->partial) {
+		lpartial_bind(func->partial, frame);
+	}
+
+	int used = l->arity - bound;
+	for (int i = 0; i < used; ++i) {
+		frame->vals[bound + i] = args->cell[i];
+	}
+
+	if (l->rest) {
+		lval* rest = lval_qexpr();
+		for (int i = used; i < args->count; ++i) {
+			lval_add(rest, args->cell[i]);
+		}
+		frame->vals[l->arity] = rest;
+	}
+
+	args->count = 0;
+	lval_del(args);
+
+	lval* result = NULL;
+	ljit_fn fn = ljit_fallback ? NULL : ljit_code(l, e);
+	long num;
+
+	if (fn && fn(frame, &num)) {
+		result = lval_num(num);
+	} else if (fn) {
+		ljit_fallback = 1;
+		result = llambda_eval(l, frame);
+		ljit_fallback = 0;
+	} else {
+		result = llambda_eval(l, frame);
+	}
+
+	lenv_del(frame);
+	return result;
+}
+
+lenv* lenv_new(void) {
+	lenv* e = malloc(sizeof(lenv));
+	e->par = NULL;
+	e->interp = NULL;
+	e->count = 0;
+	e->syms = NULL;
+	e->vals = NULL;
+	e->params = 0;
+	e->borrowed = 0;
+
+	return e;
+}
+
+// A call frame with one binding for each parameter of the lambda, whose
+// values the caller fills in. The lambda must outlive the frame.
+lenv* lenv_frame(lenv* par, llambda* l) {
+	int count = l->arity + l->rest;
+	lenv* e = malloc(sizeof(lenv) + sizeof(lval*) * count);
+	e->par = par;
+	e->interp = par->interp;
+	e->count = count;
+	e->syms = l->params;
+	e->vals = (lval**) (e + 1);
+	e->params = count;
+	e->borrowed = 1;
+	return e;
+}
+
+// The top-level environment of an interpreter is the last one in the chain
+// that belongs to it. For forked interpreters it sits above the base's one.
+lenv* lenv_top(lenv* e) {
+	while (e->par && e->par->interp == e->interp) {
+		e = e->par;
+	}
+	return e;
+}
+
+lispora* lenv_interp(lenv* e) {
+	return e->interp;
+}
+
+void lenv_del(lenv* e) {
+	for (int i = 0; i < e->count; ++i) {
+		if (i >= e->params) {
+			atomic_fetch_sub_explicit(&e->syms[i]->shadow, 1, memory_order_relaxed);
+		}
+		lval_del(e->vals[i]);
+	}
+	if (!e->borrowed) {
+		free(e->syms);
+		free(e->vals);
+	}
+	free(e);
+}
+
+lval* lenv_get(lenv* e, lval* key) {
+	lsym* sym = key->sym;
+
+	// Body symbols know where their formal sits in the frame. Anything else
+	// that lands in that slot, such as the frame of another lambda evaluating
+	// a quoted body, fails the check and takes the dynamic lookup.
+	if (key->slot >= 0 && key->slot < e->count && e->syms[key->slot] == sym) {
+		return lval_copy(e->vals[key->slot]);
+	}
+
+	if (atomic_load_explicit(&sym->shadow, memory_order_relaxed)) {
+		for (; e->par; e = e->par) {
+			for (int i = 0; i < e->count; ++i) {
+				if (e->syms[i] == sym) {
+					return lval_copy(e->vals[i]);
+				}
+			}
+		}
+	}
+
+	if (sym->global) {
+		return lval_copy(sym->global);
+	} else {
+		return lval_err_unbound(sym);
+	}
+}
+
+void lenv_def(lenv* e, lval* key, lval* v) {
+	lenv_put(lenv_top(e), key, v);
+}
+
+void lenv_put(lenv* e, lval* key, lval* v) {
+	lenv_bind(e, key->sym, lval_copy(v));
+}
+
+// Like lenv_put, but takes ownership of the value instead of copying it.
+void lenv_bind(lenv* e, lsym* sym, lval* v) {
+	// The root environment keeps its bindings in the symbols.
+	if (e->interp && !e->par) {
+		if (sym->global) {
+			lval_del(sym->global);
+		}
+		sym->global = v;
+		sym->version++;
+		return;
+	}
+
+	for (int i = 0; i < e->count; ++i) {
+		if (e->syms[i] == sym) {
+			lval_del(e->vals[i]);
+			e->vals[i] = v;
+			return;
+		}
+	}
+
+	e->count++;
+
+	// Frames of a call get arrays of their own once they bind anything else.
+	if (e->borrowed) {
+		lsym** syms = malloc(sizeof(lsym*) * e->count);
+		lval** vals = malloc(sizeof(lval*) * e->count);
+		memcpy(syms, e->syms, sizeof(lsym*) * (e->count - 1));
+		memcpy(vals, e->vals, sizeof(lval*) * (e->count - 1));
+		e->syms = syms;
+		e->vals = vals;
+		e->borrowed = 0;
+	} else {
+		e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+		e->syms = realloc(e->syms, sizeof(lsym*) * e->count);
+	}
+
+	e->vals[e->count-1] = v;
+	e->syms[e->count-1] = sym;
+	atomic_fetch_add_explicit(&sym->shadow, 1, memory_order_relaxed);
+}
+
+lval* builtin_head(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("head", args, 1);
+
+	if (args->cell[0]->type == LVAL_SEQ) {
+		lseq* s = args->cell[0]->seq;
+		LASSERT(args, lseq_first(s), "Function 'head' passed {} for argument 0.");
+
+		lval* head = lval_add(lval_qexpr(), lval_copy(s->first));
+		lval_del(args);
+		return head;
+	}
+
+	LASSERT_TYPE("head", args, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("head", args, 0);
+
+	lval* head = lval_take(args, 0);
+	while(head->count > 1) {
+		lval_del(lval_pop(head, 1));
+	}
+
+	return head;
+}
+
+lval* builtin_tail(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("tail", args, 1);
+
+	if (args->cell[0]->type == LVAL_SEQ) {
+		lseq* s = args->cell[0]->seq;
+		LASSERT(args, lseq_first(s), "Function 'tail' passed {} for argument 0.");
+
+		lval* tail = lval_seq(lseq_ref(s->rest));
+		lval_del(args);
+		return tail;
+	}
+
+	LASSERT_TYPE("tail", args, 0, LVAL_QEXPR);
+	LASSERT_NOT_EMPTY("tail", args, 0);
+
+	lval* tail = lval_take(args, 0);
+	lval_del(lval_pop(tail, 0));
+	return tail;
+}
+
+lval* builtin_list(lenv* e, lval* args) {
+	args->type = LVAL_QEXPR;
+	return lval_intern(lenv_interp(e)->syms->cons, args);
+}
+
+lval* builtin_eval(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("eval", args, 1);
+	LASSERT_TYPE("eval", args, 0, LVAL_QEXPR);
+
+	lval* x = lval_take(args, 0);
+	x->type = LVAL_SEXPR;
+	return lval_eval(e, x);
+}
+
+lval* lval_join(lval* first, lval* second) {
+	while (second->count) {
+		first = lval_add(first, lval_pop(second, 0));
+	}
+
+	lval_del(second);
+	return first;
+}
+
+lval* builtin_join(lenv* e, lval* v) {
+	int lazy = 0;
+	for (int i = 0; i < v->count; ++i) {
+		if (v->cell[i]->type == LVAL_SEQ) {
+			lazy = 1;
+			continue;
+		}
+		LASSERT_TYPE("join", v, i, LVAL_QEXPR);
+	}
+
+	if (lazy) {
+		return lval_join_lazy(v);
+	}
+
+	lval* res = lval_pop(v, 0);
+	while(v->count) {
+		res = lval_join(res, lval_pop(v, 0));
+	}
+
+	lval_del(v);
+	return res;
+}
+
+lval* builtin_lambda(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("\\", args, 2);
+	LASSERT_TYPE("\\", args, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", args, 1, LVAL_QEXPR);
+
+	// Check if the first Q-Expression contains only symbols
+	for (int i = 0; i < args->cell[0]->count; ++i) {
+		LASSERT(args, (args->cell[0]->cell[i]->type == LVAL_SYM),
+				"Cannot define non-symbol. Got %s, expected %s",
+				ltype_name(args->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+
+	// The signature is built once here, so malformed formals are rejected
+	// up front rather than on the call that reaches them.
+	lval* params = args->cell[0];
+	for (int i = 0; i < params->count; ++i) {
+		LASSERT(args, strcmp(params->cell[i]->sym->name, "&") || i == params->count - 2,
+				"Function format invalid. Symbol '&' not followed by single symbol");
+		for (int j = 0; j < i; ++j) {
+			LASSERT(args, params->cell[i]->sym != params->cell[j]->sym,
+					"Function format invalid. Symbol '%s' bound twice", params->cell[i]->sym->name);
+		}
+	}
+
+	// The body gets addressed and folded in place, so it must not share
+	// any hash-consed nodes.
+	lval* formals = lval_pop(args, 0);
+	lval* body = lval_unshare(lval_pop(args, 0));
+	lval_del(args);
+
+	lval_address(body, formals);
+
+	lval* func = lval_lambda(formals, body);
+	llambda_fold(func->lambda, e);
+
+	if (lenv_interp(e)->closures) {
+		llambda* l = func->lambda;
+		l->body_node = lnode_branch(l->body);
+		if (l->code) {
+			l->code_node = lnode_branch(l->code);
+		}
+	}
+	return func;
+
+}
+
+lval* builtin_op(lenv* e, lval* args, char* op) {
+	for (int i = 0; i < args->count; ++i) {
+		LASSERT_TYPE(op, args, i, LVAL_NUM);
+	}
+
+	lval* first = lval_pop(args, 0);
+
+	if (!strcmp(op, "-") && args->count == 0) {
+		first->num = -first->num;
+	}
+
+	while (args->count > 0) {
+		lval* next = lval_pop(args, 0);
+
+		if (!strcmp(op, "+")) {
+			first->num += next->num;
+		} else if (!strcmp(op, "-")) {
+			first->num -= next->num;
+		} else if (!strcmp(op, "*")) {
+			first->num *= next->num;
+		} else if (!strcmp(op, "/")) {
+			if (next->num == 0) {
+				lval_del(first);
+				lval_del(next);
+				ltrail_reset();
+				first = lval_copy(&lval_div_zero);
+				break;
+			}
+			first->num /= next->num;
+		}
+
+		lval_del(next);
+	}
+
+	lval_del(args);
+	return first;
+}
+
+lval* builtin_add(lenv* e, lval* args) {
+	return builtin_op(e, args, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* args) {
+	return builtin_op(e, args, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* args) {
+	return builtin_op(e, args, "*");
+}
+
+lval* builtin_div(lenv* e, lval* args) {
+	return builtin_op(e, args, "/");
+}
+
+lval* builtin_ord(lenv* env, lval* args, char* op) {
+	LASSERT_NUM_ARGS(op, args, 2);
+	LASSERT_TYPE(op, args, 0, LVAL_NUM);
+	LASSERT_TYPE(op, args, 1, LVAL_NUM);
+
+	int res;
+	if (!strcmp(op, ">")) {
+		res = (args->cell[0]->num > args->cell[1]->num);
+	} else if (!strcmp(op, "<")) {
+		res = (args->cell[0]->num < args->cell[1]->num);
+	} else if (!strcmp(op, ">=")) {
+		res = (args->cell[0]->num >= args->cell[1]->num);
+	} else if (!strcmp(op, "<=")) {
+		res = (args->cell[0]->num <= args->cell[1]->num);
+	}
+
+	lval_del(args);
+	return lval_num(res);
+}
+
+lval* builtin_gt(lenv* e, lval* args) {
+	return builtin_ord(e, args, ">");
+}
+
+lval* builtin_lt(lenv* e, lval* args) {
+	return builtin_ord(e, args, "<");
+}
+
+lval* builtin_ge(lenv* e, lval* args) {
+	return builtin_ord(e, args, ">=");
+}
+
+lval* builtin_le(lenv* e, lval* args) {
+	return builtin_ord(e, args, "<=");
+}
+
+int lval_eq(lval* first, lval* second) {
+	if (first == second) {
+		return 1;
+	}
+	if (first->cons && first->cons == second->cons) {
+		return 0;
+	}
+
+	// Sequences are equal to expressions and sequences with equal items.
+	if (first->type == LVAL_SEQ || second->type == LVAL_SEQ) {
+		if (first->type != LVAL_SEQ) {
+			lval* x = first;
+			first = second;
+			second = x;
+		}
+		if (second->type == LVAL_QEXPR) {
+			return lseq_eq(first->seq, second);
+		}
+		if (second->type != LVAL_SEQ) {
+			return 0;
+		}
+
+		lseq* s = first->seq;
+		lseq* t = second->seq;
+		for (; s != t; s = s->rest, t = t->rest) {
+			if (!lseq_first(s) || !lseq_first(t)) {
+				return !lseq_first(s) && !lseq_first(t);
+			}
+			if (!lval_eq(s->first, t->first)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	if (first->type != second->type) {
+		return 0;
+	}
+
+	switch (first->type) {
+		case LVAL_NUM:
+			return first->num == second->num;
+		case LVAL_ERR:
+			return first->err->code == second->err->code &&
+				!strcmp(lerr_message(first->err), lerr_message(second->err));
+		case LVAL_SYM:
+			return first->sym == second->sym;
+		case LVAL_STR:
+			return lstr_eq(first->str, second->str);
+		case LVAL_FUN:
+			if (first->builtin || second->builtin) {
+				return first->builtin == second->builtin && first->memo == second->memo;
+			} else {
+				int first_bound = first->partial ? first->partial->bound : 0;
+				int second_bound = second->partial ? second->partial->bound : 0;
+				lval* first_formals = first->lambda->formals;
+				lval* second_formals = second->lambda->formals;
+
+				if (first_formals->count - first_bound != second_formals->count - second_bound) {
+					return 0;
+				}
+				for (int i = 0; first_bound + i < first_formals->count; ++i) {
+					if (!lval_eq(first_formals->cell[first_bound + i], second_formals->cell[second_bound + i])) {
+						return 0;
+					}
+				}
+				return lval_eq(first->lambda->body, second->lambda->body);
+			}
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			if (first->count != second->count) {
+				return 0;
+			}
+			for (int i = 0; i < first->count; ++i) {
+				if (!lval_eq(first->cell[i], second->cell[i])) {
+					return 0;
+				}
+			}
+			return 1;
+		case LVAL_FUT:
+			return first->task == second->task;
+	}
+
+	return 0;
+}
+
+// Structural hash, equal for any two values lval_eq considers equal.
+unsigned long lval_hash(lval* v) {
+	if (v->cons) {
+		return v->hash;
+	}
+
+	// Sequences hash like the expressions they are equal to, so hashing one
+	// realizes all of it.
+	unsigned long h = 14695981039346656037UL ^ (v->type == LVAL_SEQ ? LVAL_QEXPR : v->type);
+
+	switch (v->type) {
+		case LVAL_NUM:
+			h ^= (unsigned long) v->num;
+			break;
+		case LVAL_ERR:
+			h ^= lsym_hash(lerr_message(v->err));
+			break;
+		case LVAL_SYM:
+			h ^= (unsigned long) v->sym;
+			break;
+		case LVAL_STR:
+			h ^= lsym_hash(lstr_chars(v->str));
+			break;
+		case LVAL_FUN:
+			if (v->builtin) {
+				h ^= (unsigned long) v->builtin ^ (unsigned long) v->memo;
+			} else {
+				lval* formals = v->lambda->formals;
+				for (int i = v->partial ? v->partial->bound : 0; i < formals->count; ++i) {
+					h = (h ^ (unsigned long) formals->cell[i]->sym) * 1099511628211UL;
+				}
+				h ^= lval_hash(v->lambda->body);
+			}
+			break;
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			for (int i = 0; i < v->count; ++i) {
+				h = (h ^ lval_hash(v->cell[i])) * 1099511628211UL;
+			}
+			break;
+		case LVAL_FUT:
+			h ^= (unsigned long) v->task;
+			break;
+		case LVAL_SEQ:
+			for (lseq* s = v->seq; lseq_first(s); s = s->rest) {
+				h = (h ^ lval_hash(s->first)) * 1099511628211UL;
+			}
+			break;
+	}
+
+	return h * 1099511628211UL;
+}
+
+lval* builtin_cmp(lenv* e, lval* args, char* op) {
+	LASSERT_NUM_ARGS(op, args, 2);
+	int res;
+	if (!strcmp(op, "==")) {
+		res = lval_eq(args->cell[0], args->cell[1]);
+	} else if (!strcmp(op, "!=")) {
+		res = !lval_eq(args->cell[0], args->cell[1]);
+	}
+
+	lval_del(args);
+	return lval_num(res);
+}
+
+lval* builtin_eq(lenv* e, lval* args) {
+	return builtin_cmp(e, args, "==");
+}
+
+lval* builtin_ne(lenv* e, lval* args) {
+	return builtin_cmp(e, args, "!=");
+}
+
+lval* builtin_if(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("if", args, 3);
+	LASSERT_TYPE("if", args, 0, LVAL_NUM);
+	LASSERT_TYPE("if", args, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", args, 2, LVAL_QEXPR);
+
+	lval* x = lval_pop(args, args->cell[0]->num ? 1 : 2);
+	x->type = LVAL_SEXPR;
+	x = lval_eval(e, x);
+
+	lval_del(args);
+	return x;
+}
+
+lval* builtin_var(lenv* e, lval* args, char* func) {
+	LASSERT_TYPE(func, args, 0, LVAL_QEXPR);
+
+	lval* syms = args->cell[0];
+	for (int i = 0; i < syms->count; ++i) {
+		LASSERT(args, (syms->cell[i]->type == LVAL_SYM),
+				"Function '%s' cannot define non-symbol. Got %s, expected %s",
+				func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+
+	LASSERT(args, (syms->count == args->count-1),
+			"Function '%s' got too many arguments for symbols. Got %i, expected %i.",
+			func, syms->count, args->count-1);
+
+	LASSERT(args, !(lparallel && !strcmp(func, "def")),
+			"Function '%s' cannot be used inside a parallel section.", func);
+
+	// Running tasks read the root environment, let them finish first.
+	if (!strcmp(func, "def")) {
+		lsched_quiesce(lenv_interp(e)->sched);
+	}
+
+	for (int i = 0; i < syms->count; ++i) {
+		if (!strcmp(func, "def")) {
+			lenv_def(e, syms->cell[i], args->cell[i+1]);
+		} else if (!strcmp(func, "=")) {
+			lenv_put(e, syms->cell[i], args->cell[i+1]);
+		}
+	}
+
+	lval_del(args);
+	return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* args) {
+	return builtin_var(e, args, "def");
+}
+
+lval* builtin_put(lenv* e, lval* args) {
+	return builtin_var(e, args, "=");
+}
+
+lval* builtin_print(lenv* e, lval* args) {
+	lispora* l = lenv_interp(e);
+
+	pthread_mutex_lock(&l->out_lock);
+	for (int i = 0; i < args->count; ++i) {
+		lval_print(&l->out, args->cell[i]);
+		lbuf_putc(&l->out, ' ');
+	}
+
+	lbuf_putc(&l->out, '\n');
+	pthread_mutex_unlock(&l->out_lock);
+	lval_del(args);
+
+	return lval_sexpr();
+}
+
+// Writes the values to a file opened with the mode, strings as their
+// characters and everything else the way `print` shows it.
+lval* builtin_output(lenv* e, lval* args, char* func, char* mode) {
+	LASSERT(args, args->count >= 1,
+			"Function '%s' passed incorrect number of arguments. Got %i, expected at least 1.",
+			func, args->count);
+	LASSERT_TYPE(func, args, 0, LVAL_STR);
+
+	char* path = lstr_chars(args->cell[0]->str);
+	FILE* f = fopen(path, mode);
+	LASSERT(args, f, "Function '%s' could not open file '%s': %s",
+			func, path, strerror(errno));
+
+	lbuf b;
+	lbuf_init(&b, f);
+	for (int i = 1; i < args->count; ++i) {
+		if (args->cell[i]->type == LVAL_STR) {
+			lbuf_chars(&b, args->cell[i]->str, 0);
+		} else {
+			lval_print(&b, args->cell[i]);
+		}
+	}
+	lbuf_drain(&b);
+	lbuf_free(&b);
+
+	int failed = ferror(f);
+	failed |= fclose(f);
+	LASSERT(args, !failed, "Function '%s' could not write file '%s'", func, path);
+
+	lval_del(args);
+	return lval_sexpr();
+}
+
+lval* builtin_write_file(lenv* e, lval* args) {
+	return builtin_output(e, args, "write-file", "w");
+}
+
+lval* builtin_append_file(lenv* e, lval* args) {
+	return builtin_output(e, args, "append-file", "a");
+}
+
+// Writes out buffered output. The arguments are ignored.
+lval* builtin_flush(lenv* e, lval* args) {
+	lispora_flush(lenv_interp(e));
+	lval_del(args);
+	return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("error", args, 1);
+	LASSERT_TYPE("error", args, 0, LVAL_STR);
+
+	lval* err = lval_err("%s", lstr_chars(args->cell[0]->str));
+	err->err->code = LERR_USER;
+
+	lval_del(args);
+
+	return err;
+}
+
+// Evaluates the body, and if that fails the handler instead. A function
+// gets called with the message of the error, a Q-Expression is evaluated.
+lval* builtin_try(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("try", args, 2);
+	LASSERT_TYPE("try", args, 0, LVAL_QEXPR);
+	LASSERT(args, args->cell[1]->type == LVAL_FUN || args->cell[1]->type == LVAL_QEXPR,
+			"Function 'try' passed incorrect type of argument 1. Got %s, expected %s or %s.",
+			ltype_name(args->cell[1]->type), ltype_name(LVAL_FUN), ltype_name(LVAL_QEXPR));
+
+	lval* body = lval_pop(args, 0);
+	body->type = LVAL_SEXPR;
+	lval* x = lval_eval(e, body);
+	if (x->type != LVAL_ERR) {
+		lval_del(args);
+		return x;
+	}
+
+	ltrail_reset();
+
+	lval* handler = lval_take(args, 0);
+	if (handler->type == LVAL_QEXPR) {
+		lval_del(x);
+		handler->type = LVAL_SEXPR;
+		return lval_eval(e, handler);
+	}
+
+	lval* msg = lval_str(lerr_message(x->err));
+	lval_del(x);
+
+	lval* result = lval_apply(e, handler, lval_add(lval_sexpr(), msg));
+	lval_del(handler);
+	return result;
+}
+
+lval* lval_import(lenv* e, char* filename) {
+	mpc_result_t r;
+	if (!mpc_parse_contents(filename, lenv_interp(e)->Program, &r)) {
+		char* err_msg = mpc_err_string(r.error);
+		mpc_err_delete(r.error);
+
+		lval* err = lval_err("Could not import file '%s'", err_msg);
+		free(err_msg);
+
+		return err;
+	}
+
+	return lval_eval_program(e, filename, r.output);
+}
+
+// Source names are interned like symbols, so locations can refer to them
+// for as long as the interpreter lives.
+lval* lval_eval_program(lenv* e, const char* name, mpc_ast_t* tree) {
+	lispora* l = lenv_interp(e);
+
+	lval* expr = lval_read(l->syms, lsym_intern(l->syms, (char*) name), tree);
+	mpc_ast_delete(tree);
+
+	while (expr->count) {
+		lval* curr = lval_eval(e, lval_pop(expr, 0));
+		if (curr->type == LVAL_ERR) {
+			pthread_mutex_lock(&l->out_lock);
+			lval_print(&l->out, curr);
+			ltrail_print(&l->out, curr);
+			lbuf_putc(&l->out, '\n');
+			pthread_mutex_unlock(&l->out_lock);
+		}
+		lval_del(curr);
+	}
+
+	lval_del(expr);
+	return lval_sexpr();
+}
+
+lval* builtin_import(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("import", args, 1);
+	LASSERT_TYPE("import", args, 0, LVAL_STR);
+	LASSERT(args, !lparallel,
+			"Function 'import' cannot be used inside a parallel section.");
+
+	lval* res = lval_import(e, lstr_chars(args->cell[0]->str));
+	lval_del(args);
+	return res;
+}
+
+lval* lval_apply(lenv* e, lval* func, lval* args) {
+	lval* f = lval_copy(func);
+	lval* result = lval_call(e, f, args);
+	lval_del(f);
+	return result;
+}
+
+void ldeque_init(ldeque* d) {
+	ltask_array* a = malloc(sizeof(ltask_array) + sizeof(ltask*) * 64);
+	a->size = 64;
+	a->prev = NULL;
+
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	atomic_init(&d->array, a);
+}
+
+void ldeque_free(ldeque* d) {
+	ltask_array* a = atomic_load(&d->array);
+	while (a) {
+		ltask_array* prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+void ldeque_push(ldeque* d, ltask* t) {
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	ltask_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+	if (b - top > a->size - 1) {
+		ltask_array* grown = malloc(sizeof(ltask_array) + sizeof(ltask*) * a->size * 2);
+		grown->size = a->size * 2;
+		grown->prev = a;
+		for (long i = top; i < b; ++i) {
+			atomic_store_explicit(&grown->tasks[i % grown->size],
+					atomic_load_explicit(&a->tasks[i % a->size], memory_order_relaxed),
+					memory_order_relaxed);
+		}
+		atomic_store_explicit(&d->array, grown, memory_order_release);
+		a = grown;
+	}
+
+	atomic_store_explicit(&a->tasks[b % a->size], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+ltask* ldeque_take(ldeque* d) {
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	ltask_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	if (top > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	ltask* t = atomic_load_explicit(&a->tasks[b % a->size], memory_order_relaxed);
+	if (top == b) {
+		// Last task left, race the thieves for it.
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+					memory_order_seq_cst, memory_order_relaxed)) {
+			t = NULL;
+		}
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+
+	return t;
+}
+
+ltask* ldeque_steal(ldeque* d) {
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+	if (top >= b) {
+		return NULL;
+	}
+
+	ltask_array* a = atomic_load_explicit(&d->array, memory_order_acquire);
+	ltask* t = atomic_load_explicit(&a->tasks[top % a->size], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+
+	return t;
+}
+
+// Starts the pool on first use. Forks share it, so they may get here from
+// several threads at once.
+void lsched_start(lsched* s) {
+	if (atomic_load_explicit(&s->started, memory_order_acquire)) {
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (!atomic_load_explicit(&s->started, memory_order_relaxed)) {
+		int size = s->requested > 0 ? s->requested : (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (size < 1) {
+			size = 1;
+		}
+		s->size = size;
+
+		// Threads outside of the pool work while they wait on tasks, so it
+		// has one worker less than its size.
+		s->deques = malloc(sizeof(ldeque) * size);
+		s->threads = malloc(sizeof(pthread_t) * size);
+		for (int i = 0; i < size - 1; ++i) {
+			ldeque_init(&s->deques[i]);
+			s->deques[i].sched = s;
+		}
+		for (int i = 0; i < size - 1; ++i) {
+			pthread_create(&s->threads[i], NULL, lsched_worker, &s->deques[i]);
+		}
+
+		atomic_store_explicit(&s->started, 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void lsched_shutdown(lsched* s) {
+	if (!atomic_load(&s->started)) {
+		return;
+	}
+
+	lsched_quiesce(s);
+
+	pthread_mutex_lock(&s->lock);
+	atomic_store(&s->shutdown, 1);
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+
+	for (int i = 0; i < s->size - 1; ++i) {
+		pthread_join(s->threads[i], NULL);
+	}
+
+	for (int i = 0; i < s->size - 1; ++i) {
+		ldeque_free(&s->deques[i]);
+	}
+
+	free(s->threads);
+	free(s->deques);
+	s->size = 0;
+	atomic_store(&s->started, 0);
+}
+
+void* lsched_worker(void* deque) {
+	lsched* s = ((ldeque*) deque)->sched;
+	lworker = (ldeque*) deque - s->deques;
+
+	while (!atomic_load(&s->shutdown)) {
+		if (lsched_help(s)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		atomic_fetch_add(&s->sleeping, 1);
+		if (!atomic_load(&s->queued) && !atomic_load(&s->shutdown)) {
+			pthread_cond_wait(&s->work, &s->lock);
+		}
+		atomic_fetch_sub(&s->sleeping, 1);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+void lsched_push(lsched* s, ltask* t) {
+	lsched_start(s);
+
+	atomic_fetch_add(&s->outstanding, 1);
+	if (lworker >= 0) {
+		ldeque_push(&s->deques[lworker], t);
+	} else {
+		pthread_mutex_lock(&s->lock);
+		if (s->inject_last) {
+			s->inject_last->next = t;
+		} else {
+			s->inject = t;
+		}
+		s->inject_last = t;
+		atomic_fetch_add(&s->injected, 1);
+		pthread_mutex_unlock(&s->lock);
+	}
+	atomic_fetch_add(&s->queued, 1);
+
+	if (atomic_load(&s->sleeping)) {
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_signal(&s->work);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+// Takes the oldest task of the injection queue, if any.
+ltask* lsched_inject_take(lsched* s) {
+	if (!atomic_load(&s->injected)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	ltask* t = s->inject;
+	if (t) {
+		s->inject = t->next;
+		if (!s->inject) {
+			s->inject_last = NULL;
+		}
+		atomic_fetch_sub(&s->injected, 1);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return t;
+}
+
+// Runs one queued task, preferring the newest one of the current thread over
+// injected ones and those over the oldest ones of the workers. Returns 0 when
+// nothing could be found.
+int lsched_help(lsched* s) {
+	ltask* t = lworker >= 0 ? ldeque_take(&s->deques[lworker]) : NULL;
+	if (!t) {
+		t = lsched_inject_take(s);
+	}
+	for (int i = 1; !t && i < s->size; ++i) {
+		t = ldeque_steal(&s->deques[(lworker + i) % (s->size - 1)]);
+	}
+
+	if (!t) {
+		return 0;
+	}
+
+	atomic_fetch_sub(&s->queued, 1);
+	ltask_exec(t);
+	return 1;
+}
+
+void lsched_quiesce(lsched* s) {
+	while (atomic_load(&s->outstanding)) {
+		if (!lsched_help(s)) {
+			sched_yield();
+		}
+	}
+}
+
+ltask* ltask_new(lsched* s, void (*run)(ltask* t)) {
+	ltask* t = calloc(1, sizeof(ltask));
+	t->run = run;
+	t->sched = s;
+	atomic_init(&t->done, 0);
+	atomic_init(&t->refs, 1);
+	return t;
+}
+
+void ltask_exec(ltask* t) {
+	int parallel = lparallel;
+	lparallel = 1;
+	t->run(t);
+	lparallel = parallel;
+
+	atomic_store_explicit(&t->done, 1, memory_order_release);
+	atomic_fetch_sub(&t->sched->outstanding, 1);
+	ltask_release(t);
+}
+
+void ltask_release(ltask* t) {
+	if (atomic_fetch_sub(&t->refs, 1) != 1) {
+		return;
+	}
+
+	if (t->result) {
+		lval_del(t->result);
+	}
+	free(t);
+}
+
+void ltask_apply(ltask* t) {
+	t->result = lval_apply(t->env, t->func, t->args);
+	lval_del(t->func);
+	t->func = NULL;
+	t->args = NULL;
+}
+
+void ltask_chunk(ltask* t) {
+	ljob_chunk(t->job, t->chunk);
+	atomic_fetch_sub(&t->job->pending, 1);
+}
+
+// Each chunk evaluates in a frame of its own above the caller's environment,
+// so anything bound while it runs stays out of the chain the others read.
+void ljob_chunk(ljob* job, int c) {
+	int start = c * job->chunk_size;
+	int end = start + job->chunk_size;
+	if (end > job->items->count) {
+		end = job->items->count;
+	}
+
+	lenv* env = lenv_new();
+	env->par = job->env;
+	env->interp = job->env->interp;
+
+	if (!job->init) {
+		for (int i = start; i < end; ++i) {
+			lval* args = lval_add(lval_sexpr(), lval_copy(job->items->cell[i]));
+			job->results[i] = lval_apply(env, job->func, args);
+		}
+		lenv_del(env);
+		return;
+	}
+
+	lval* acc = lval_copy(job->items->cell[start]);
+	for (int i = start + 1; i < end && acc->type != LVAL_ERR; ++i) {
+		lval* args = lval_add(lval_sexpr(), acc);
+		args = lval_add(args, lval_copy(job->items->cell[i]));
+		acc = lval_apply(env, job->func, args);
+	}
+	job->results[c] = acc;
+	lenv_del(env);
+}
+
+// Splits the job into chunk tasks and helps running them until all are done.
+// The caller's environment chain is only read in the meantime, as chunks
+// have frames of their own and 'def' is refused inside parallel sections.
+void ljob_exec(lsched* s, ljob* job) {
+	lsched_start(s);
+
+	// Several chunks per worker keep the load balanced when items differ in cost.
+	int size = job->items->count / (s->size * 4);
+	job->chunk_size = size > 0 ? size : 1;
+	job->chunks = (job->items->count + job->chunk_size - 1) / job->chunk_size;
+	atomic_init(&job->pending, job->chunks);
+
+	for (int c = 0; c < job->chunks; ++c) {
+		ltask* t = ltask_new(s, ltask_chunk);
+		t->job = job;
+		t->chunk = c;
+		lsched_push(s, t);
+	}
+
+	while (atomic_load(&job->pending)) {
+		if (!lsched_help(s)) {
+			sched_yield();
+		}
+	}
+}
+
+lval* builtin_pmap(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("pmap", args, 2);
+	LASSERT_TYPE("pmap", args, 0, LVAL_FUN);
+	LASSERT_TYPE("pmap", args, 1, LVAL_QEXPR);
+
+	lval* items = args->cell[1];
+
+	ljob job = { e, args->cell[0], items, NULL };
+	job.results = malloc(sizeof(lval*) * items->count);
+	ljob_exec(lenv_interp(e)->sched, &job);
+
+	lval* res = lval_qexpr();
+	for (int i = 0; i < items->count; ++i) {
+		if (res->type != LVAL_ERR && job.results[i]->type == LVAL_ERR) {
+			lval_del(res);
+			res = job.results[i];
+		} else if (res->type == LVAL_ERR) {
+			lval_del(job.results[i]);
+		} else {
+			res = lval_add(res, job.results[i]);
+		}
+	}
+
+	free(job.results);
+	lval_del(args);
+	return res;
+}
+
+lval* builtin_preduce(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("preduce", args, 3);
+	LASSERT_TYPE("preduce", args, 0, LVAL_FUN);
+	LASSERT_TYPE("preduce", args, 2, LVAL_QEXPR);
+
+	lval* items = args->cell[2];
+	lval* acc = lval_copy(args->cell[1]);
+
+	if (items->count == 0) {
+		lval_del(args);
+		return acc;
+	}
+
+	// Each chunk is folded from its first element, so the function should be
+	// associative for the result to match a sequential fold.
+	ljob job = { e, args->cell[0], items, acc };
+	job.results = malloc(sizeof(lval*) * items->count);
+	ljob_exec(lenv_interp(e)->sched, &job);
+
+	for (int c = 0; c < job.chunks; ++c) {
+		if (acc->type == LVAL_ERR) {
+			lval_del(job.results[c]);
+		} else if (job.results[c]->type == LVAL_ERR) {
+			lval_del(acc);
+			acc = job.results[c];
+		} else {
+			lval* step = lval_add(lval_sexpr(), acc);
+			step = lval_add(step, job.results[c]);
+			acc = lval_apply(e, args->cell[0], step);
+		}
+	}
+
+	free(job.results);
+	lval_del(args);
+	return acc;
+}
+
+lval* builtin_spawn(lenv* e, lval* args) {
+	LASSERT(args, args->count >= 1,
+			"Function 'spawn' passed incorrect number of arguments. Got %i, expected at least %i.",
+			args->count, 1);
+	LASSERT_TYPE("spawn", args, 0, LVAL_FUN);
+
+	// The spawning frame may be gone by the time the task runs, so tasks are
+	// evaluated against the top-level environment.
+	e = lenv_top(e);
+
+	ltask* t = ltask_new(e->interp->sched, ltask_apply);
+	t->env = e;
+	t->func = lval_pop(args, 0);
+	t->args = args;
+
+	atomic_fetch_add(&t->refs, 1);
+	lsched_push(t->sched, t);
+
+	return lval_fut(t);
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
+lval* builtin_await(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("await", args, 1);
+	LASSERT_TYPE("await", args, 0, LVAL_FUT);
 
-	int i;
-	for (i = 0; i < v->count; ++i) {
-		lval_print(v->cell[i]);
-		if (i != v->count-1) {
-			putchar(' ');
+	ltask* t = args->cell[0]->task;
+	while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+		if (!lsched_help(t->sched)) {
+			sched_yield();
 		}
 	}
-	putchar(close);
+
+	lval* result = lval_copy(t->result);
+	lval_del(args);
+	return result;
 }
 
-void lval_print(lval* v) {
-	switch (v->type) {
-		case LVAL_NUM:
-			printf("%li", v->num);
-			break;
-		case LVAL_ERR:
-			printf("Error: %s", v->err);
-			break;
-		case LVAL_SYM:
-			printf("%s", v->sym);
-			break;
-		case LVAL_STR:
-			lval_print_str(v);
-			break;
-		case LVAL_SEXPR:
-			lval_expr_print(v, '(', ')');
-			break;
-		case LVAL_QEXPR:
-			lval_expr_print(v, '{', '}');
-			break;
-		case LVAL_FUN:
-			if (v->builtin) {
-				printf("<function>");
-			} else {
-				printf("(\\ ");
-				lval_print(v->formals);
-				putchar(' ');
-				lval_print(v->body);
-				putchar(')');
-			}
-			break;
+/* Memoization */
+
+lmemo* lmemo_new(lsymtab* syms, lval* func, int capacity) {
+	lmemo* m = malloc(sizeof(lmemo));
+	atomic_init(&m->refs, 1);
+	m->func = func;
+	m->syms = syms;
+	pthread_mutex_init(&m->lock, NULL);
+
+	m->capacity = capacity;
+	m->count = 0;
+	m->entries = malloc(sizeof(lmemo_entry) * capacity);
+	m->first = -1;
+	m->last = -1;
+
+	// Keep the table at most half full.
+	m->size = 1;
+	while (m->size < capacity * 2) {
+		m->size *= 2;
 	}
+	m->slots = malloc(sizeof(int) * m->size);
+	for (int i = 0; i < m->size; ++i) {
+		m->slots[i] = -1;
+	}
+
+	return m;
 }
 
-void lval_println(lval* v) {
-	lval_print(v);
-	putchar('\n');
+void lmemo_release(lmemo* m) {
+	if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+		for (int i = 0; i < m->count; ++i) {
+			lval_del(m->entries[i].args);
+			lval_del(m->entries[i].result);
+		}
+		lval_del(m->func);
+		pthread_mutex_destroy(&m->lock);
+		free(m->entries);
+		free(m->slots);
+		free(m);
+	}
 }
 
-lval* lval_pop(lval* v, int i) {
-	lval* item = v->cell[i];
-	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i - 1));
-	v->count--;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+int lmemo_find(lmemo* m, unsigned long hash, lval* args) {
+	for (unsigned long i = hash & (m->size - 1); m->slots[i] != -1; i = (i + 1) & (m->size - 1)) {
+		lmemo_entry* x = &m->entries[m->slots[i]];
+		if (x->hash == hash && lval_eq(x->args, args)) {
+			return m->slots[i];
+		}
+	}
+	return -1;
+}
 
-	return item;
+void lmemo_unlink(lmemo* m, int i) {
+	lmemo_entry* x = &m->entries[i];
+	if (x->prev != -1) {
+		m->entries[x->prev].next = x->next;
+	} else {
+		m->first = x->next;
+	}
+	if (x->next != -1) {
+		m->entries[x->next].prev = x->prev;
+	} else {
+		m->last = x->prev;
+	}
 }
 
-lval* lval_take(lval* v, int i) {
-	lval* item = lval_pop(v, i);
-	lval_del(v);
-	return item;
+void lmemo_touch(lmemo* m, int i) {
+	m->entries[i].prev = -1;
+	m->entries[i].next = m->first;
+	if (m->first != -1) {
+		m->entries[m->first].prev = i;
+	} else {
+		m->last = i;
+	}
+	m->first = i;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-	for (int i = 0; i < v->count; ++i) {
-		v->cell[i] = lval_eval(e, v->cell[i]);
+// Takes the entry out of the table, moving later entries of its probe
+// sequence back so no lookup stops short.
+void lmemo_remove(lmemo* m, int i) {
+	unsigned long mask = m->size - 1;
+	unsigned long hole = m->entries[i].hash & mask;
+	while (m->slots[hole] != i) {
+		hole = (hole + 1) & mask;
 	}
 
-	for (int i = 0; i < v->count; ++i) {
-		if (v->cell[i]->type == LVAL_ERR) {
-			return lval_take(v, i);
+	for (unsigned long j = (hole + 1) & mask; m->slots[j] != -1; j = (j + 1) & mask) {
+		unsigned long home = m->entries[m->slots[j]].hash & mask;
+		int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+		if (!stays) {
+			m->slots[hole] = m->slots[j];
+			hole = j;
 		}
 	}
+	m->slots[hole] = -1;
+}
 
-	if (v->count == 0) {
-		return v;
+void lmemo_insert(lmemo* m, unsigned long hash, lval* args, lval* result) {
+	int i;
+	if (m->count < m->capacity) {
+		i = m->count++;
+	} else {
+		i = m->last;
+		lmemo_remove(m, i);
+		lmemo_unlink(m, i);
+		lval_del(m->entries[i].args);
+		lval_del(m->entries[i].result);
 	}
 
-	if (v->count == 1) {
-		return lval_take(v, 0);
-	}
+	m->entries[i].hash = hash;
+	m->entries[i].args = args;
+	m->entries[i].result = result;
+	lmemo_touch(m, i);
 
-	lval* first = lval_pop(v, 0);
-	if (first->type != LVAL_FUN) {
-		lval* err = lval_err(
-				"S-Expression starts with incorrect type. Got %s, expected %s.",
-				ltype_name(first->type), ltype_name(LVAL_FUN));
-		lval_del(v);
-		lval_del(first);
-		return err;
+	unsigned long j = hash & (m->size - 1);
+	while (m->slots[j] != -1) {
+		j = (j + 1) & (m->size - 1);
 	}
-
-	lval* result = lval_call(e, first, v);
-	lval_del(first);
-	return result;
+	m->slots[j] = i;
 }
 
-lval* lval_call(lenv* e, lval* func, lval* args) {
-	if (func->builtin) {
-		return func->builtin(e, args);
+// Whether the cache can keep the value. Symbols interned by a fork are freed
+// with it, so values holding them are not kept by caches of its base.
+int lmemo_keeps(lmemo* m, lval* v) {
+	switch (v->type) {
+		case LVAL_ERR:
+			return !v->err->sym || lsym_find(m->syms, v->err->sym->name) == v->err->sym;
+		case LVAL_SYM:
+			return lsym_find(m->syms, v->sym->name) == v->sym;
+		case LVAL_FUN:
+			if (v->builtin) {
+				return !v->memo || lmemo_keeps(m, v->memo->func);
+			}
+			for (lpartial* p = v->partial; p; p = p->prev) {
+				for (int i = 0; i < p->count; ++i) {
+					if (!lmemo_keeps(m, p->args[i])) {
+						return 0;
+					}
+				}
+			}
+			return lmemo_keeps(m, v->lambda->formals) && lmemo_keeps(m, v->lambda->body);
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			for (int i = 0; i < v->count; ++i) {
+				if (!lmemo_keeps(m, v->cell[i])) {
+					return 0;
+				}
+			}
+			return 1;
+		case LVAL_FUT:
+		case LVAL_SEQ:
+			return 0;
 	}
+	return 1;
+}
 
-	int given = args->count;
-	int total = func->formals->count;
+// The lock is not held while the function runs, so it can recurse through
+// its own cache. Errors are not cached.
+lval* lmemo_call(lenv* e, lmemo* m, lval* args) {
+	unsigned long hash = lval_hash(args);
+
+	pthread_mutex_lock(&m->lock);
+	int i = lmemo_find(m, hash, args);
+	if (i != -1) {
+		lmemo_unlink(m, i);
+		lmemo_touch(m, i);
+		lval* x = lval_copy(m->entries[i].result);
+		pthread_mutex_unlock(&m->lock);
+		lval_del(args);
+		return x;
+	}
+	pthread_mutex_unlock(&m->lock);
 
-	while(args->count) {
-		if (func->formals->count == 0) {
-			lval_del(args);
-			return lval_err("Function passed too amny arguments. Got %i, expected %i.",
-					given, total);
-		}
+	lval* key = lval_copy(args);
+	lval* x = lval_call(e, m->func, args);
 
-		lval* sym = lval_pop(func->formals, 0);
+	if (x->type == LVAL_ERR) {
+		lval_del(key);
+		return x;
+	}
 
-		if (!strcmp(sym->sym, "&")) {
-			if (func->formals->count != 1) {
-				lval_del(args);
-				return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
-			}
+	if (lenv_interp(e)->syms != m->syms && (!lmemo_keeps(m, key) || !lmemo_keeps(m, x))) {
+		lval_del(key);
+		return x;
+	}
 
-			lval* next_sym = lval_pop(func->formals, 0);
-			lenv_put(func->env, next_sym, builtin_list(e, args));
-			lval_del(sym);
-			lval_del(next_sym);
-			break;
-		}
+	pthread_mutex_lock(&m->lock);
+	if (lmemo_find(m, hash, key) == -1) {
+		lmemo_insert(m, hash, key, lval_copy(x));
+	} else {
+		lval_del(key);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return x;
+}
 
-		lval* val = lval_pop(args, 0);
-		lenv_put(func->env, sym, val);
+// Stands in for the builtin of memoized functions, which lval_call sends
+// to their cache instead.
+lval* builtin_memoized(lenv* e, lval* args) {
+	lval_del(args);
+	return lval_err("Memoized function called without its cache.");
+}
 
-		lval_del(sym);
-		lval_del(val);
+lval* builtin_memo(lenv* e, lval* args) {
+	LASSERT(args, args->count == 1 || args->count == 2,
+			"Function 'memo' passed incorrect number of arguments. Got %i, expected 1 or 2.",
+			args->count);
+	LASSERT_TYPE("memo", args, 0, LVAL_FUN);
+
+	int capacity = 4096;
+	if (args->count == 2) {
+		LASSERT_TYPE("memo", args, 1, LVAL_NUM);
+		LASSERT(args, args->cell[1]->num > 0 && args->cell[1]->num <= 1 << 24,
+				"Function 'memo' passed invalid capacity %li.", args->cell[1]->num);
+		capacity = args->cell[1]->num;
 	}
 
+	lval* v = lval_fun(builtin_memoized);
+	v->memo = lmemo_new(lenv_interp(e)->syms, lval_pop(args, 0), capacity);
 	lval_del(args);
+	return v;
+}
 
-	if (func->formals->count > 0 &&
-			!(strcmp(func->formals->cell[0]->sym, "&"))) {
-		if (func->formals->count != 2) {
-			return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
-		}
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+	lval* key = lval_sym(lsym_intern(lenv_interp(e)->syms, name));
+	lval* val = lval_fun(func);
 
-		lval_del(lval_pop(func->formals, 0));
+	lenv_put(e, key, val);
+
+	lval_del(key);
+	lval_del(val);
+}
+
+/* Strings */
+
+lstr* lstr_new(char* str, size_t len) {
+	lstr* s = malloc(sizeof(lstr) + len + 1);
+	atomic_init(&s->refs, 1);
+	s->len = len;
+	s->height = 0;
+	s->left = NULL;
+	s->right = NULL;
+	memcpy(s->data, str, len);
+	s->data[len] = '\0';
+	atomic_init(&s->flat, s->data);
+	return s;
+}
 
-		lval* sym = lval_pop(func->formals, 0);
-		lval* val = lval_qexpr();
+lstr* lstr_ref(lstr* s) {
+	atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+	return s;
+}
 
-		lenv_put(func->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+void lstr_release(lstr* s) {
+	if (atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) != 1) {
+		return;
 	}
 
-	if (func->formals->count == 0) {
-		func->env->par = e;
-		return builtin_eval(func->env, lval_add(lval_sexpr(), lval_copy(func->body)));
-	} else {
-		return lval_copy(func);
+	if (s->left) {
+		lstr_release(s->left);
+		lstr_release(s->right);
+		free(atomic_load(&s->flat));
 	}
+	free(s);
 }
 
-lenv* lenv_new(void) {
-	lenv* e = malloc(sizeof(lenv));
-	e->par = NULL;
-	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
+// Takes both halves.
+lstr* lstr_node(lstr* left, lstr* right) {
+	lstr* s = malloc(sizeof(lstr));
+	atomic_init(&s->refs, 1);
+	s->len = left->len + right->len;
+	s->height = (left->height > right->height ? left->height : right->height) + 1;
+	s->left = left;
+	s->right = right;
+	atomic_init(&s->flat, NULL);
+	return s;
+}
 
-	return e;
+// (a (b c)) becomes ((a b) c).
+lstr* lstr_rotate_left(lstr* s) {
+	lstr* r = s->right;
+	lstr* x = lstr_node(lstr_node(lstr_ref(s->left), lstr_ref(r->left)), lstr_ref(r->right));
+	lstr_release(s);
+	return x;
 }
 
-void lenv_del(lenv* e) {
-	for (int i = 0; i < e->count; ++i) {
-		free(e->syms[i]);
-		lval_del(e->vals[i]);
-	}
-	free(e->syms);
-	free(e->vals);
-	free(e);
+// ((a b) c) becomes (a (b c)).
+lstr* lstr_rotate_right(lstr* s) {
+	lstr* l = s->left;
+	lstr* x = lstr_node(lstr_ref(l->left), lstr_node(lstr_ref(l->right), lstr_ref(s->right)));
+	lstr_release(s);
+	return x;
 }
 
-lval* lenv_get(lenv* e, lval* key) {
-	for (int i = 0; i < e->count; ++i) {
-		if (!strcmp(e->syms[i], key->sym)) {
-			return lval_copy(e->vals[i]);
+// Joins a right half into the right spine of a left one that is more than
+// one level higher, rotating on the way back up to keep it balanced.
+lstr* lstr_join_right(lstr* left, lstr* right) {
+	lstr* l = lstr_ref(left->left);
+	lstr* c = lstr_ref(left->right);
+	lstr_release(left);
+
+	if (c->height <= right->height + 1) {
+		lstr* t = lstr_join(c, right);
+		if (t->height <= l->height + 1) {
+			return lstr_node(l, t);
 		}
+		return lstr_rotate_left(lstr_node(l, lstr_rotate_right(t)));
 	}
 
-	if (e->par) {
-		return lenv_get(e->par, key);
-	} else {
-		return lval_err("Unbound symbol: '%s'", key->sym);
+	lstr* t = lstr_join_right(c, right);
+	int high = t->height > l->height + 1;
+	lstr* x = lstr_node(l, t);
+	return high ? lstr_rotate_left(x) : x;
+}
+
+lstr* lstr_join_left(lstr* left, lstr* right) {
+	lstr* c = lstr_ref(right->left);
+	lstr* r = lstr_ref(right->right);
+	lstr_release(right);
+
+	if (c->height <= left->height + 1) {
+		lstr* t = lstr_join(left, c);
+		if (t->height <= r->height + 1) {
+			return lstr_node(t, r);
+		}
+		return lstr_rotate_right(lstr_node(lstr_rotate_left(t), r));
 	}
 
+	lstr* t = lstr_join_left(left, c);
+	int high = t->height > r->height + 1;
+	lstr* x = lstr_node(t, r);
+	return high ? lstr_rotate_right(x) : x;
 }
 
-lenv* lenv_copy(lenv* e) {
-	lenv* copy = malloc(sizeof(lenv));
-	copy->par = e->par;
-	copy->count = e->count;
-	copy->syms = malloc(sizeof(char*) * copy->count);
-	copy->vals = malloc(sizeof(lval*) * copy->count);
+// Concatenates two strings, taking both. Short leaves are copied into one,
+// which keeps fragments appended one at a time from becoming single leaves.
+lstr* lstr_join(lstr* left, lstr* right) {
+	if (!left->len || !right->len) {
+		lstr* s = left->len ? left : right;
+		lstr_release(left->len ? right : left);
+		return s;
+	}
 
-	for (int i = 0; i < e->count; ++i) {
-		copy->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(copy->syms[i], e->syms[i]);
-		copy->vals[i] = lval_copy(e->vals[i]);
+	if (!left->left && !right->left && left->len + right->len <= LSTR_LEAF) {
+		char buf[LSTR_LEAF];
+		memcpy(buf, left->data, left->len);
+		memcpy(buf + left->len, right->data, right->len);
+		lstr* s = lstr_new(buf, left->len + right->len);
+		lstr_release(left);
+		lstr_release(right);
+		return s;
 	}
 
-	return copy;
+	if (left->height > right->height + 1) {
+		return lstr_join_right(left, right);
+	}
+	if (right->height > left->height + 1) {
+		return lstr_join_left(left, right);
+	}
+	return lstr_node(left, right);
 }
 
-void lenv_def(lenv* e, lval* key, lval* v) {
-	while (e->par) {
-		e = e->par;
+// The characters from start on, sharing whole parts of the string.
+lstr* lstr_sub(lstr* s, size_t start, size_t len) {
+	if (start == 0 && len == s->len) {
+		return lstr_ref(s);
+	}
+	if (!s->left) {
+		return lstr_new(s->data + start, len);
 	}
 
-	lenv_put(e, key, v);
+	size_t half = s->left->len;
+	if (start + len <= half) {
+		return lstr_sub(s->left, start, len);
+	}
+	if (start >= half) {
+		return lstr_sub(s->right, start - half, len);
+	}
+	return lstr_join(lstr_sub(s->left, start, half - start),
+			lstr_sub(s->right, 0, start + len - half));
 }
 
-void lenv_put(lenv* e, lval* key, lval* v) {
-	for (int i = 0; i < e->count; ++i) {
-		if (!strcmp(e->syms[i], key->sym)) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
+void lstr_write(lstr* s, char* out) {
+	while (s->left) {
+		char* flat = atomic_load_explicit(&s->flat, memory_order_acquire);
+		if (flat) {
+			memcpy(out, flat, s->len);
 			return;
 		}
+		lstr_write(s->left, out);
+		out += s->left->len;
+		s = s->right;
 	}
-
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
-
-	e->vals[e->count-1] = lval_copy(v);
-	e->syms[e->count-1] = malloc(strlen(key->sym) + 1);
-	strcpy(e->syms[e->count-1], key->sym);
+	memcpy(out, s->data, s->len);
 }
 
-lval* builtin_head(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("head", args, 1);
-	LASSERT_TYPE("head", args, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("head", args, 0);
-
-	lval* head = lval_take(args, 0);
-	while(head->count > 1) {
-		lval_del(lval_pop(head, 1));
+// The characters as a C string, flattened once and kept with the string.
+char* lstr_chars(lstr* s) {
+	char* flat = atomic_load_explicit(&s->flat, memory_order_acquire);
+	if (flat) {
+		return flat;
 	}
 
-	return head;
-}
-
-lval* builtin_tail(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("tail", args, 1);
-	LASSERT_TYPE("tail", args, 0, LVAL_QEXPR);
-	LASSERT_NOT_EMPTY("tail", args, 0);
+	char* chars = malloc(s->len + 1);
+	lstr_write(s, chars);
+	chars[s->len] = '\0';
 
-	lval* tail = lval_take(args, 0);
-	lval_del(lval_pop(tail, 0));
-	return tail;
+	if (!atomic_compare_exchange_strong_explicit(&s->flat, &flat, chars,
+				memory_order_acq_rel, memory_order_acquire)) {
+		free(chars);
+		return flat;
+	}
+	return chars;
 }
 
-lval* builtin_list(lenv* e, lval* args) {
-	args->type = LVAL_QEXPR;
-	return args;
+int lstr_eq(lstr* first, lstr* second) {
+	return first == second || (first->len == second->len &&
+			!memcmp(lstr_chars(first), lstr_chars(second), first->len));
 }
 
-lval* builtin_eval(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("eval", args, 1);
-	LASSERT_TYPE("eval", args, 0, LVAL_QEXPR);
-
-	lval* x = lval_take(args, 0);
-	x->type = LVAL_SEXPR;
-	return lval_eval(e, x);
-}
+// The first occurrence of the needle in the characters, or NULL.
+char* lstr_find(char* chars, size_t len, char* needle, size_t size) {
+	if (!size) {
+		return chars;
+	}
 
-lval* lval_join(lval* first, lval* second) {
-	while (second->count) {
-		first = lval_add(first, lval_pop(second, 0));
+	char* end = chars + len;
+	for (char* p = chars; end - p >= (long) size; ++p) {
+		p = memchr(p, needle[0], end - p - size + 1);
+		if (!p) {
+			return NULL;
+		}
+		if (!memcmp(p, needle, size)) {
+			return p;
+		}
 	}
+	return NULL;
+}
 
-	lval_del(second);
-	return first;
+lval* lval_lstr(lstr* str) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_STR;
+	v->str = str;
+	return v;
 }
 
-lval* builtin_join(lenv* e, lval* v) {
-	for (int i = 0; i < v->count; ++i) {
-		LASSERT_TYPE("join", v, i, LVAL_QEXPR);
+lval* builtin_concat(lenv* e, lval* args) {
+	for (int i = 0; i < args->count; ++i) {
+		LASSERT_TYPE("concat", args, i, LVAL_STR);
 	}
 
-	lval* res = lval_pop(v, 0);
-	while(v->count) {
-		res = lval_join(res, lval_pop(v, 0));
+	lstr* s = lstr_new("", 0);
+	for (int i = 0; i < args->count; ++i) {
+		s = lstr_join(s, lstr_ref(args->cell[i]->str));
 	}
 
-	lval_del(v);
-	return res;
+	lval_del(args);
+	return lval_lstr(s);
 }
 
-lval* builtin_lambda(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("\\", args, 2);
-	LASSERT_TYPE("\\", args, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", args, 1, LVAL_QEXPR);
+lval* builtin_substring(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("substring", args, 3);
+	LASSERT_TYPE("substring", args, 0, LVAL_STR);
+	LASSERT_TYPE("substring", args, 1, LVAL_NUM);
+	LASSERT_TYPE("substring", args, 2, LVAL_NUM);
 
-	// Check if the first Q-Expression contains only symbols
-	for (int i = 0; i < args->cell[0]->count; ++i) {
-		LASSERT(args, (args->cell[0]->cell[i]->type == LVAL_SYM),
-				"Cannot define non-symbol. Got %s, expected %s",
-				ltype_name(args->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
-	}
+	lstr* s = args->cell[0]->str;
+	long start = args->cell[1]->num;
+	long end = args->cell[2]->num;
+	LASSERT(args, 0 <= start && start <= end && end <= (long) s->len,
+			"Function 'substring' passed invalid range %li to %li for a string of length %li.",
+			start, end, (long) s->len);
 
-	lval* formals = lval_pop(args, 0);
-	lval* body = lval_pop(args, 0);
+	lval* x = lval_lstr(lstr_sub(s, start, end - start));
 	lval_del(args);
-
-	return lval_lambda(formals, body);
-
+	return x;
 }
 
-lval* builtin_op(lenv* e, lval* args, char* op) {
-	for (int i = 0; i < args->count; ++i) {
-		LASSERT_TYPE(op, args, i, LVAL_NUM);
-	}
-
-	lval* first = lval_pop(args, 0);
+lval* builtin_index_of(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("index-of", args, 2);
+	LASSERT_TYPE("index-of", args, 0, LVAL_STR);
+	LASSERT_TYPE("index-of", args, 1, LVAL_STR);
 
-	if (!strcmp(op, "-") && args->count == 0) {
-		first->num = -first->num;
-	}
+	lstr* s = args->cell[0]->str;
+	lstr* needle = args->cell[1]->str;
+	char* chars = lstr_chars(s);
+	char* found = lstr_find(chars, s->len, lstr_chars(needle), needle->len);
 
-	while (args->count > 0) {
-		lval* next = lval_pop(args, 0);
+	lval* x = lval_num(found ? found - chars : -1);
+	lval_del(args);
+	return x;
+}
 
-		if (!strcmp(op, "+")) {
-			first->num += next->num;
-		} else if (!strcmp(op, "-")) {
-			first->num -= next->num;
-		} else if (!strcmp(op, "*")) {
-			first->num *= next->num;
-		} else if (!strcmp(op, "/")) {
-			if (next->num == 0) {
-				lval_del(first);
-				lval_del(next);
-				first = lval_err("Division by zero.");
-				break;
-			}
-			first->num /= next->num;
+lval* builtin_split(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("split", args, 2);
+	LASSERT_TYPE("split", args, 0, LVAL_STR);
+	LASSERT_TYPE("split", args, 1, LVAL_STR);
+	LASSERT(args, args->cell[1]->str->len != 0,
+			"Function 'split' passed an empty separator.");
+
+	lstr* s = args->cell[0]->str;
+	lstr* sep = args->cell[1]->str;
+	char* chars = lstr_chars(s);
+	char* end = chars + s->len;
+
+	lval* x = lval_qexpr();
+	for (char* p = chars;;) {
+		char* found = lstr_find(p, end - p, lstr_chars(sep), sep->len);
+		if (!found) {
+			x = lval_add(x, lval_lstr(lstr_sub(s, p - chars, end - p)));
+			break;
 		}
-
-		lval_del(next);
+		x = lval_add(x, lval_lstr(lstr_sub(s, p - chars, found - p)));
+		p = found + sep->len;
 	}
 
 	lval_del(args);
-	return first;
+	return x;
 }
 
-lval* builtin_add(lenv* e, lval* args) {
-	return builtin_op(e, args, "+");
+lval* builtin_length(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("length", args, 1);
+	LASSERT_TYPE("length", args, 0, LVAL_STR);
+
+	lval* x = lval_num(args->cell[0]->str->len);
+	lval_del(args);
+	return x;
 }
 
-lval* builtin_sub(lenv* e, lval* args) {
-	return builtin_op(e, args, "-");
+/* Lazy sequences */
+
+void lgen_init(lgen* g, lval* (*next)(lgen* g), void (*free)(lgen* g)) {
+	atomic_init(&g->refs, 1);
+	pthread_mutex_init(&g->lock, NULL);
+	g->next = next;
+	g->free = free;
 }
 
-lval* builtin_mul(lenv* e, lval* args) {
-	return builtin_op(e, args, "*");
+void lgen_release(lgen* g) {
+	if (atomic_fetch_sub_explicit(&g->refs, 1, memory_order_acq_rel) == 1) {
+		pthread_mutex_destroy(&g->lock);
+		g->free(g);
+	}
 }
 
-lval* builtin_div(lenv* e, lval* args) {
-	return builtin_op(e, args, "/");
+// Takes the reference to the generator.
+lseq* lseq_new(lgen* gen) {
+	lseq* s = malloc(sizeof(lseq));
+	atomic_init(&s->refs, 1);
+	atomic_init(&s->realized, 0);
+	s->first = NULL;
+	s->rest = NULL;
+	s->gen = gen;
+	return s;
 }
 
-lval* builtin_ord(lenv* env, lval* args, char* op) {
-	LASSERT_NUM_ARGS(op, args, 2);
-	LASSERT_TYPE(op, args, 0, LVAL_NUM);
-	LASSERT_TYPE(op, args, 1, LVAL_NUM);
+lseq* lseq_ref(lseq* s) {
+	atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+	return s;
+}
 
-	int res;
-	if (!strcmp(op, ">")) {
-		res = (args->cell[0]->num > args->cell[1]->num);
-	} else if (!strcmp(op, "<")) {
-		res = (args->cell[0]->num < args->cell[1]->num);
-	} else if (!strcmp(op, ">=")) {
-		res = (args->cell[0]->num >= args->cell[1]->num);
-	} else if (!strcmp(op, "<=")) {
-		res = (args->cell[0]->num <= args->cell[1]->num);
+// Iterative, so dropping a long realized sequence does not recurse.
+void lseq_release(lseq* s) {
+	while (s && atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) == 1) {
+		lseq* rest = s->rest;
+		if (s->first) {
+			lval_del(s->first);
+		}
+		lgen_release(s->gen);
+		free(s);
+		s = rest;
 	}
-
-	lval_del(args);
-	return lval_num(res);
 }
 
-lval* builtin_gt(lenv* e, lval* args) {
-	return builtin_ord(e, args, ">");
+// Realizes the node if needed. Returns its first item, or NULL at the end.
+lval* lseq_first(lseq* s) {
+	if (!atomic_load_explicit(&s->realized, memory_order_acquire)) {
+		lgen* g = s->gen;
+		pthread_mutex_lock(&g->lock);
+		if (!atomic_load_explicit(&s->realized, memory_order_relaxed)) {
+			s->first = g->next(g);
+			if (s->first) {
+				atomic_fetch_add_explicit(&g->refs, 1, memory_order_relaxed);
+				s->rest = lseq_new(g);
+			}
+			atomic_store_explicit(&s->realized, 1, memory_order_release);
+		}
+		pthread_mutex_unlock(&g->lock);
+	}
+	return s->first;
 }
 
-lval* builtin_lt(lenv* e, lval* args) {
-	return builtin_ord(e, args, "<");
+lval* lval_seq(lseq* seq) {
+	lval* v = malloc(sizeof(lval));
+	v->cons = NULL;
+	v->type = LVAL_SEQ;
+	v->seq = seq;
+	return v;
 }
 
-lval* builtin_ge(lenv* e, lval* args) {
-	return builtin_ord(e, args, ">=");
+// Whether the items of a sequence are those of an expression, realizing no
+// more than one item past its end.
+int lseq_eq(lseq* s, lval* x) {
+	for (int i = 0; i < x->count; ++i, s = s->rest) {
+		if (!lseq_first(s) || !lval_eq(s->first, x->cell[i])) {
+			return 0;
+		}
+	}
+	return !lseq_first(s);
 }
 
-lval* builtin_le(lenv* e, lval* args) {
-	return builtin_ord(e, args, "<=");
+llines* llines_open(char* path) {
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	llines* r = malloc(sizeof(llines));
+	lgen_init(&r->gen, llines_next, llines_free);
+	r->file = f;
+	r->cap = LLINES_SIZE;
+	r->buf = malloc(r->cap);
+	r->start = 0;
+	r->len = 0;
+	r->error = 0;
+	return r;
 }
 
-int lval_eq(lval* first, lval* second) {
-	if (first->type != second->type) {
-		return 0;
-	}
+// Finds the next line in the buffer, reading more of the file only when the
+// rest of the buffer holds no complete line. The line stays valid until the
+// next call and does not include its newline.
+int llines_read(llines* r, char** line, size_t* len) {
+	while (1) {
+		char* begin = r->buf + r->start;
+		size_t avail = r->len - r->start;
+
+		char* end = memchr(begin, '\n', avail);
+		if (end) {
+			*line = begin;
+			*len = end - begin;
+			r->start += *len + 1;
+			return 1;
+		}
 
-	switch (first->type) {
-		case LVAL_NUM:
-			return first->num == second->num;
-		case LVAL_ERR:
-			return !strcmp(first->err, second->err);
-		case LVAL_SYM:
-			return !strcmp(first->sym, second->sym);
-		case LVAL_STR:
-			return !strcmp(first->str, second->str);
-		case LVAL_FUN:
-			if (first->builtin || second->builtin) {
-				return first->builtin == second->builtin;
-			} else {
-				return lval_eq(first->formals, second->formals) &&
-					lval_eq(first->body, second->body);
-			}
-		case LVAL_QEXPR:
-		case LVAL_SEXPR:
-			if (first->count != second->count) {
+		if (!r->file) {
+			if (!avail) {
 				return 0;
 			}
-			for (int i = 0; i < first->count; ++i) {
-				if (!lval_eq(first->cell[i], second->cell[i])) {
-					return 0;
-				}
-			}
+			*line = begin;
+			*len = avail;
+			r->start = r->len;
 			return 1;
-	}
+		}
 
-	return 0;
+		// Keep the partial line and read more after it.
+		memmove(r->buf, begin, avail);
+		r->start = 0;
+		r->len = avail;
+		if (r->len == r->cap) {
+			r->cap *= 2;
+			r->buf = realloc(r->buf, r->cap);
+		}
+
+		size_t n = fread(r->buf + r->len, 1, r->cap - r->len, r->file);
+		r->len += n;
+		if (n == 0) {
+			r->error = ferror(r->file) ? errno : 0;
+			fclose(r->file);
+			r->file = NULL;
+		}
+	}
 }
 
-lval* builtin_cmp(lenv* e, lval* args, char* op) {
-	LASSERT_NUM_ARGS(op, args, 2);
-	int res;
-	if (!strcmp(op, "==")) {
-		res = lval_eq(args->cell[0], args->cell[1]);
-	} else if (!strcmp(op, "!=")) {
-		res = !lval_eq(args->cell[0], args->cell[1]);
+lval* llines_next(lgen* g) {
+	llines* r = (llines*) g;
+
+	char* line;
+	size_t len;
+	if (llines_read(r, &line, &len)) {
+		return lval_lstr(lstr_new(line, len));
 	}
 
-	lval_del(args);
-	return lval_num(res);
+	if (r->error) {
+		lval* err = lval_err("Could not read lines: %s", strerror(r->error));
+		r->error = 0;
+		return err;
+	}
+	return NULL;
 }
 
-lval* builtin_eq(lenv* e, lval* args) {
-	return builtin_cmp(e, args, "==");
+void llines_free(lgen* g) {
+	llines* r = (llines*) g;
+	if (r->file) {
+		fclose(r->file);
+	}
+	free(r->buf);
+	free(r);
 }
 
-lval* builtin_ne(lenv* e, lval* args) {
-	return builtin_cmp(e, args, "!=");
+lval* builtin_read_lines(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("read-lines", args, 1);
+	LASSERT_TYPE("read-lines", args, 0, LVAL_STR);
+
+	char* path = lstr_chars(args->cell[0]->str);
+	llines* r = llines_open(path);
+	LASSERT(args, r, "Function 'read-lines' could not open file '%s': %s",
+			path, strerror(errno));
+
+	lval_del(args);
+	return lval_seq(lseq_new(&r->gen));
 }
 
-lval* builtin_if(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("if", args, 3);
-	LASSERT_TYPE("if", args, 0, LVAL_NUM);
-	LASSERT_TYPE("if", args, 1, LVAL_QEXPR);
-	LASSERT_TYPE("if", args, 2, LVAL_QEXPR);
+// Calls the function on every line of a file, with the result of the
+// previous call in front if folding. Lines are read straight from the
+// buffer without building a sequence.
+lval* builtin_lines(lenv* e, lval* args, char* func, int fold) {
+	int expect = fold ? 3 : 2;
+	LASSERT_NUM_ARGS(func, args, expect);
+	LASSERT_TYPE(func, args, 0, LVAL_STR);
+	LASSERT_TYPE(func, args, 1, LVAL_FUN);
+
+	char* path = lstr_chars(args->cell[0]->str);
+	llines* r = llines_open(path);
+	LASSERT(args, r, "Function '%s' could not open file '%s': %s",
+			func, path, strerror(errno));
+
+	lval* f = args->cell[1];
+	lval* acc = fold ? lval_pop(args, 2) : lval_sexpr();
+
+	char* line;
+	size_t len;
+	while (acc->type != LVAL_ERR && llines_read(r, &line, &len)) {
+		lval* call = lval_sexpr();
+		if (fold) {
+			call = lval_add(call, acc);
+		}
+		call = lval_add(call, lval_lstr(lstr_new(line, len)));
 
-	lval* x;
-	args->cell[1]->type = LVAL_SEXPR;
-	args->cell[2]->type = LVAL_SEXPR;
+		lval* x = lval_apply(e, f, call);
+		if (fold || x->type == LVAL_ERR) {
+			if (!fold) {
+				lval_del(acc);
+			}
+			acc = x;
+		} else {
+			lval_del(x);
+		}
+	}
 
-	if (args->cell[0]->num) {
-		x = lval_eval(e, lval_pop(args, 1));
-	} else {
-		x = lval_eval(e, lval_pop(args, 2));
+	if (acc->type != LVAL_ERR && r->error) {
+		lval_del(acc);
+		acc = lval_err("Function '%s' could not read file '%s': %s",
+				func, path, strerror(r->error));
 	}
 
+	lgen_release(&r->gen);
 	lval_del(args);
-	return x;
+	return acc;
 }
 
-lval* builtin_var(lenv* e, lval* args, char* func) {
-	LASSERT_TYPE(func, args, 0, LVAL_QEXPR);
+lval* builtin_fold_lines(lenv* e, lval* args) {
+	return builtin_lines(e, args, "fold-lines", 1);
+}
 
-	lval* syms = args->cell[0];
-	for (int i = 0; i < syms->count; ++i) {
-		LASSERT(args, (syms->cell[i]->type == LVAL_SYM),
-				"Function '%s' cannot define non-symbol. Got %s, expected %s",
-				func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+lval* builtin_for_each_line(lenv* e, lval* args) {
+	return builtin_lines(e, args, "for-each-line", 0);
+}
+
+// Items of a Q-Expression, taken out of it one at a time.
+lval* llist_next(lgen* g) {
+	llist* r = (llist*) g;
+	if (r->next == r->list->count) {
+		return NULL;
 	}
+	return r->list->cell[r->next++];
+}
 
-	LASSERT(args, (syms->count == args->count-1),
-			"Function '%s' got too many arguments for symbols. Got %i, expected %i.",
-			func, syms->count, args->count-1);
+void llist_free(lgen* g) {
+	llist* r = (llist*) g;
+	lval* list = r->list;
+	memmove(list->cell, list->cell + r->next, sizeof(lval*) * (list->count - r->next));
+	list->count -= r->next;
+	lval_del(list);
+	free(r);
+}
 
-	for (int i = 0; i < syms->count; ++i) {
-		if (!strcmp(func, "def")) {
-			lenv_def(e, syms->cell[i], args->cell[i+1]);
-		} else if (!strcmp(func, "=")) {
-			lenv_put(e, syms->cell[i], args->cell[i+1]);
-		}
+// The sequence of a sequence or Q-Expression, taking the value.
+lseq* lseq_of(lval* v) {
+	if (v->type == LVAL_SEQ) {
+		lseq* s = lseq_ref(v->seq);
+		lval_del(v);
+		return s;
 	}
 
-	lval_del(args);
-	return lval_sexpr();
+	llist* r = malloc(sizeof(llist));
+	lgen_init(&r->gen, llist_next, llist_free);
+	r->list = lval_own(v);
+	r->next = 0;
+	return lseq_new(&r->gen);
 }
 
-lval* builtin_def(lenv* e, lval* args) {
-	return builtin_var(e, args, "def");
+lval* lrange_next(lgen* g) {
+	lrange* r = (lrange*) g;
+	if (r->step > 0 ? r->next >= r->end : r->next <= r->end) {
+		return NULL;
+	}
+
+	lval* x = lval_num(r->next);
+	r->next += r->step;
+	return x;
 }
 
-lval* builtin_put(lenv* e, lval* args) {
-	return builtin_var(e, args, "=");
+void lrange_free(lgen* g) {
+	free(g);
 }
 
-lval* builtin_print(lenv* e, lval* args) {
-	for (int i = 0; i < args->count; ++i) {
-		lval_print(args->cell[i]);
-		putchar(' ');
+// The first value as it is, then the function applied to the previous one.
+// An error ends the sequence.
+lval* literate_next(lgen* g) {
+	literate* r = (literate*) g;
+	if (!r->x) {
+		return NULL;
 	}
 
-	putchar('\n');
-	lval_del(args);
+	if (r->started) {
+		r->x = lval_apply(r->env, r->func, lval_add(lval_sexpr(), r->x));
+	}
+	r->started = 1;
 
-	return lval_sexpr();
+	lval* x = lval_copy(r->x);
+	if (x->type == LVAL_ERR) {
+		lval_del(r->x);
+		r->x = NULL;
+	}
+	return x;
 }
 
-lval* builtin_error(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("error", args, 1);
-	LASSERT_TYPE("error", args, 0, LVAL_STR);
-
-	lval* err = lval_err(args->cell[0]->str);
+void literate_free(lgen* g) {
+	literate* r = (literate*) g;
+	lval_del(r->func);
+	if (r->x) {
+		lval_del(r->x);
+	}
+	free(r);
+}
 
-	lval_del(args);
+// Only the node of the source that is up next is held on to, so earlier
+// ones can go once nothing else refers to them.
+lval* lmapped_next(lgen* g) {
+	lmapped* r = (lmapped*) g;
+	lval* first = lseq_first(r->source);
+	if (!first) {
+		return NULL;
+	}
 
-	return err;
+	lseq* rest = lseq_ref(r->source->rest);
+	lval* x = lval_apply(r->env, r->func, lval_add(lval_sexpr(), lval_copy(first)));
+	lseq_release(r->source);
+	r->source = rest;
+	return x;
 }
 
-lval* builtin_import(lenv* e, lval* args) {
-	LASSERT_NUM_ARGS("import", args, 1);
-	LASSERT_TYPE("import", args, 0, LVAL_STR);
-
+void lmapped_free(lgen* g) {
+	lmapped* r = (lmapped*) g;
+	lval_del(r->func);
+	lseq_release(r->source);
+	free(r);
+}
 
-	mpc_result_t r;
-	if (mpc_parse_contents(args->cell[0]->str, Program, &r)) {
-		lval* expr = lval_read(r.output);
-		mpc_ast_delete(r.output);
-
-		while (expr->count) {
-			lval* curr = lval_eval(e, lval_pop(expr, 0));
-			if (curr->type == LVAL_ERR) {
-				lval_println(curr);
-			}
-			lval_del(curr);
+lval* ljoined_next(lgen* g) {
+	ljoined* r = (ljoined*) g;
+	for (; r->next < r->count; ++r->next) {
+		lseq* s = r->parts[r->next];
+		lval* first = lseq_first(s);
+		if (first) {
+			lval* x = lval_copy(first);
+			r->parts[r->next] = lseq_ref(s->rest);
+			lseq_release(s);
+			return x;
 		}
+	}
+	return NULL;
+}
 
-		lval_del(expr);
-		lval_del(args);
+void ljoined_free(lgen* g) {
+	ljoined* r = (ljoined*) g;
+	for (int i = 0; i < r->count; ++i) {
+		lseq_release(r->parts[i]);
+	}
+	free(r->parts);
+	free(r);
+}
 
-		return lval_sexpr();
-	} else {
-		char* err_msg = mpc_err_string(r.error);
-		mpc_err_delete(r.error);
+// Joins sequences and Q-Expressions into a sequence that is realized as
+// it gets walked.
+lval* lval_join_lazy(lval* args) {
+	ljoined* r = malloc(sizeof(ljoined));
+	lgen_init(&r->gen, ljoined_next, ljoined_free);
+	r->count = args->count;
+	r->next = 0;
+	r->parts = malloc(sizeof(lseq*) * r->count);
+	for (int i = 0; i < r->count; ++i) {
+		r->parts[i] = lseq_of(lval_pop(args, 0));
+	}
 
-		lval* err = lval_err("Could not import file '%s'", err_msg);
-		free(err_msg);
-		lval_del(args);
+	lval_del(args);
+	return lval_seq(lseq_new(&r->gen));
+}
 
-		return err;
+lval* builtin_range(lenv* e, lval* args) {
+	LASSERT(args, args->count >= 1 && args->count <= 3,
+			"Function 'range' passed incorrect number of arguments. Got %i, expected 1 to 3.",
+			args->count);
+	for (int i = 0; i < args->count; ++i) {
+		LASSERT_TYPE("range", args, i, LVAL_NUM);
 	}
+
+	lrange* r = malloc(sizeof(lrange));
+	lgen_init(&r->gen, lrange_next, lrange_free);
+	r->next = args->count > 1 ? args->cell[0]->num : 0;
+	r->end = args->cell[args->count > 1 ? 1 : 0]->num;
+	r->step = args->count > 2 ? args->cell[2]->num : 1;
+	if (!r->step) {
+		lgen_release(&r->gen);
+		LASSERT(args, 0, "Function 'range' passed a step of 0.");
+	}
+
+	lval_del(args);
+	return lval_seq(lseq_new(&r->gen));
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-	lval* key = lval_sym(name);
-	lval* val = lval_fun(func);
+lval* builtin_iterate(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("iterate", args, 2);
+	LASSERT_TYPE("iterate", args, 0, LVAL_FUN);
 
-	lenv_put(e, key, val);
+	literate* r = malloc(sizeof(literate));
+	lgen_init(&r->gen, literate_next, literate_free);
+	r->env = lenv_top(e);
+	r->func = lval_pop(args, 0);
+	r->x = lval_pop(args, 0);
+	r->started = 0;
 
-	lval_del(key);
-	lval_del(val);
+	lval_del(args);
+	return lval_seq(lseq_new(&r->gen));
+}
+
+lval* builtin_lazy_map(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("lazy-map", args, 2);
+	LASSERT_TYPE("lazy-map", args, 0, LVAL_FUN);
+	LASSERT(args, args->cell[1]->type == LVAL_QEXPR || args->cell[1]->type == LVAL_SEQ,
+			"Function 'lazy-map' passed incorrect type of argument 1. Got %s, expected %s or %s.",
+			ltype_name(args->cell[1]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ));
+
+	lmapped* r = malloc(sizeof(lmapped));
+	lgen_init(&r->gen, lmapped_next, lmapped_free);
+	r->env = lenv_top(e);
+	r->func = lval_pop(args, 0);
+	r->source = lseq_of(lval_pop(args, 0));
+
+	lval_del(args);
+	return lval_seq(lseq_new(&r->gen));
+}
+
+// Walks the sequence holding on to nothing but the node up next, so items
+// that were folded in can go unless something else refers to them.
+lval* builtin_fold(lenv* e, lval* args) {
+	LASSERT_NUM_ARGS("fold", args, 3);
+	LASSERT_TYPE("fold", args, 0, LVAL_FUN);
+	LASSERT(args, args->cell[2]->type == LVAL_QEXPR || args->cell[2]->type == LVAL_SEQ,
+			"Function 'fold' passed incorrect type of argument 2. Got %s, expected %s or %s.",
+			ltype_name(args->cell[2]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ));
+
+	lseq* s = lseq_of(lval_pop(args, 2));
+	lval* acc = lval_pop(args, 1);
+	lval* f = args->cell[0];
+
+	while (acc->type != LVAL_ERR && lseq_first(s)) {
+		lval* call = lval_add(lval_add(lval_sexpr(), acc), lval_copy(s->first));
+		lseq* rest = lseq_ref(s->rest);
+		lseq_release(s);
+		s = rest;
+		acc = lval_apply(e, f, call);
+	}
+
+	lseq_release(s);
+	lval_del(args);
+	return acc;
 }
 
 void lenv_add_builtins(lenv* e) {
@@ -1053,6 +5161,12 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "eval", builtin_eval);
 	lenv_add_builtin(e, "join", builtin_join);
 
+	/* Parallel functions */
+	lenv_add_builtin(e, "pmap", builtin_pmap);
+	lenv_add_builtin(e, "preduce", builtin_preduce);
+	lenv_add_builtin(e, "spawn", builtin_spawn);
+	lenv_add_builtin(e, "await", builtin_await);
+
 	/* Mathematical functions */
 	lenv_add_builtin(e, "+", builtin_add);
 	lenv_add_builtin(e, "-", builtin_sub);
@@ -1067,6 +5181,22 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "<", builtin_lt);
 	lenv_add_builtin(e, "<=", builtin_le);
 
+	/* String functions */
+	lenv_add_builtin(e, "concat", builtin_concat);
+	lenv_add_builtin(e, "substring", builtin_substring);
+	lenv_add_builtin(e, "index-of", builtin_index_of);
+	lenv_add_builtin(e, "split", builtin_split);
+	lenv_add_builtin(e, "length", builtin_length);
+
+	/* Sequence functions */
+	lenv_add_builtin(e, "read-lines", builtin_read_lines);
+	lenv_add_builtin(e, "fold-lines", builtin_fold_lines);
+	lenv_add_builtin(e, "for-each-line", builtin_for_each_line);
+	lenv_add_builtin(e, "range", builtin_range);
+	lenv_add_builtin(e, "iterate", builtin_iterate);
+	lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+	lenv_add_builtin(e, "fold", builtin_fold);
+
 	/* Other */
 	lenv_add_builtin(e, "def", builtin_def);
 	lenv_add_builtin(e, "=", builtin_def);
@@ -1074,7 +5204,12 @@ void lenv_add_builtins(lenv* e) {
 	lenv_add_builtin(e, "if", builtin_if);
 	lenv_add_builtin(e, "import", builtin_import);
 	lenv_add_builtin(e, "print", builtin_print);
+	lenv_add_builtin(e, "write-file", builtin_write_file);
+	lenv_add_builtin(e, "append-file", builtin_append_file);
+	lenv_add_builtin(e, "flush", builtin_flush);
 	lenv_add_builtin(e, "error", builtin_error);
+	lenv_add_builtin(e, "try", builtin_try);
+	lenv_add_builtin(e, "memo", builtin_memo);
 }
 
 lval* lval_eval(lenv* e, lval* v) {
@@ -1085,27 +5220,28 @@ lval* lval_eval(lenv* e, lval* v) {
 	}
 
 	if (v->type == LVAL_SEXPR) {
-		return lval_eval_sexpr(e, v);
+		return lval_eval_sexpr(e, lval_own(v));
 	}
 	return v;
 }
 
-int main(int argc, char** argv) {
+lispora* lispora_create(void) {
+	lispora* l = calloc(1, sizeof(lispora));
 
-	Number  = mpc_new("number");
-	Symbol  = mpc_new("symbol");
-	String  = mpc_new("string");
-	Comment = mpc_new("comment");
-	Sexpr   = mpc_new("sexpr");
-	Expr    = mpc_new("expr");
-	Qexpr   = mpc_new("qexpr");
-	Program = mpc_new("program");
+	l->Number  = mpc_new("number");
+	l->Symbol  = mpc_new("symbol");
+	l->String  = mpc_new("string");
+	l->Comment = mpc_new("comment");
+	l->Sexpr   = mpc_new("sexpr");
+	l->Expr    = mpc_new("expr");
+	l->Qexpr   = mpc_new("qexpr");
+	l->Program = mpc_new("program");
 
 	mpca_lang(MPCA_LANG_DEFAULT,
 		"                                                          \
 			number  : /-?[0-9]+/ ;                                 \
 			symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;           \
-			string  : /\"(\\\\.|[^\"])*\"/ ;                       \
+			string  : /\"(\\\\.|[^\"\\\\])*\"/ ;                   \
 			comment : /;[^\\r\\n]*/ ;                              \
 			sexpr   : '(' <expr>* ')' ;                            \
 			qexpr   : '{' <expr>* '}' ;                            \
@@ -1113,54 +5249,163 @@ int main(int argc, char** argv) {
 					| <comment> | <sexpr>  | <qexpr>;              \
 			program : /^/ <expr>* /$/ ;                            \
 		",
-		Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Program);
+		l->Number, l->Symbol, l->String, l->Comment,
+		l->Sexpr, l->Qexpr, l->Expr, l->Program);
 
-	lenv* env = lenv_new();
-	lenv_add_builtins(env);
+	l->parse = mpc_context_new();
+
+	l->syms = lsymtab_new();
+	l->env = lenv_new();
+	l->env->interp = l;
+	lenv_add_builtins(l->env);
 
-	if (argc == 1) {
-		puts("Lispora version 0.1.0.0.0");
-		puts("Press Ctrl-C for exit.");
+	lbuf_init(&l->out, stdout);
+	pthread_mutex_init(&l->out_lock, NULL);
+	l->jit = 1;
+	l->closures = 1;
 
-		while (1) {
-			char* input = readline("lispora> ");
-			add_history(input);
+	l->sched = calloc(1, sizeof(lsched));
+	pthread_mutex_init(&l->sched->lock, NULL);
+	pthread_cond_init(&l->sched->work, NULL);
 
-			mpc_result_t res;
+	return l;
+}
 
-			// Parse input from the stdin as a Program and copy the result to res.
-			// If it is successful, return 1, otherwise 0.
-			int success = mpc_parse("<stdin>", input, Program, &res);
+lispora* lispora_fork(lispora* base) {
+	lispora* l = malloc(sizeof(lispora));
+	memcpy(l, base, sizeof(lispora));
+	l->base = base;
+	l->parse = mpc_context_new();
 
-			if (success) {
-				lval* x = lval_eval(env, lval_read(res.output));
-				lval_println(x);
-				lval_del(x);
-				mpc_ast_delete(res.output);
-			} else {
-				mpc_err_print(res.error);
-				mpc_err_delete(res.error);
-			}
+	l->syms = lsymtab_new();
+	l->syms->par = base->syms;
+	l->syms->cons = base->syms->cons;
 
-			free(input);
-		}
-	}
+	l->env = lenv_new();
+	l->env->par = base->env;
+	l->env->interp = l;
 
-	if (argc >= 2) {
-		for (int i = 1; i < argc; ++i) {
-			lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-			lval* curr = builtin_import(env, args);
+	lbuf_init(&l->out, base->out.file);
+	pthread_mutex_init(&l->out_lock, NULL);
 
-			if (curr->type == LVAL_ERR) {
-				lval_println(curr);
-			}
+	return l;
+}
 
-			lval_del(curr);
-		}
+void lispora_destroy(lispora* l) {
+	lsched_quiesce(l->sched);
+	lenv_del(l->env);
+
+	lispora_flush(l);
+	lbuf_free(&l->out);
+	pthread_mutex_destroy(&l->out_lock);
+	mpc_context_delete(l->parse);
+
+	// The trail may point at the files of the interpreter.
+	ltrail_reset();
+
+	if (!l->base) {
+		lsched_shutdown(l->sched);
+		pthread_mutex_destroy(&l->sched->lock);
+		pthread_cond_destroy(&l->sched->work);
+		free(l->sched);
+		mpc_cleanup(8, l->Number, l->Symbol, l->String, l->Comment,
+				l->Sexpr, l->Qexpr, l->Expr, l->Program);
 	}
 
-	lenv_del(env);
-	mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Program);
+	lsymtab_del(l->syms);
+	free(l);
+}
+
+void lispora_flush(lispora* l) {
+	pthread_mutex_lock(&l->out_lock);
+	lbuf_drain(&l->out);
+	fflush(l->out.file);
+	pthread_mutex_unlock(&l->out_lock);
+}
+
+void lispora_set_output(lispora* l, FILE* out) {
+	lispora_flush(l);
+	l->out.file = out;
+}
+
+void lispora_set_threads(lispora* l, int threads) {
+	l->sched->requested = threads;
+}
 
+void lispora_set_jit(lispora* l, int enabled) {
+	l->jit = enabled;
+}
+
+void lispora_set_closures(lispora* l, int enabled) {
+	l->closures = enabled;
+}
+
+void lispora_set_hash_cons(lispora* l, int enabled) {
+	if (!l->syms->cons) {
+		l->syms->cons = lcons_new();
+	}
+	l->syms->cons->enabled = enabled;
+}
+
+// Reports a failed parse in the first line of the error. Returns 0.
+int lispora_parse_failed(mpc_result_t* r, char** result) {
+	if (result) {
+		*result = mpc_err_string(r->error);
+		(*result)[strcspn(*result, "\n")] = '\0';
+	}
+	mpc_err_delete(r->error);
 	return 0;
 }
+
+// Flushes the output and reports the value of an eval, which it deletes.
+// Returns whether the value is not an error.
+int lispora_finish(lispora* l, lval* x, char** result) {
+	lispora_flush(l);
+
+	int ok = x->type != LVAL_ERR;
+	if (result) {
+		*result = lval_report(x);
+	}
+
+	lval_del(x);
+	return ok;
+}
+
+int lispora_eval_string(lispora* l, const char* name, const char* source, char** result) {
+	mpc_result_t r;
+
+	// Parse the source as a Program and copy the result to r.
+	if (!mpc_parse_with(l->parse, name, source, l->Program, &r)) {
+		return lispora_parse_failed(&r, result);
+	}
+
+	lval* x = lval_eval(l->env, lval_read(l->syms, lsym_intern(l->syms, (char*) name), r.output));
+	mpc_ast_delete(r.output);
+
+	return lispora_finish(l, x, result);
+}
+
+int lispora_eval_script(lispora* l, const char* name, const char* source, char** result) {
+	mpc_result_t r;
+	if (!mpc_parse_with(l->parse, name, source, l->Program, &r)) {
+		return lispora_parse_failed(&r, result);
+	}
+
+	lval* x = lval_eval_program(l->env, name, r.output);
+	return lispora_finish(l, x, result);
+}
+
+int lispora_eval_pipe(lispora* l, const char* name, FILE* pipe, char** result) {
+	mpc_result_t r;
+	if (!mpc_parse_pipe(name, pipe, l->Program, &r)) {
+		return lispora_parse_failed(&r, result);
+	}
+
+	lval* x = lval_eval_program(l->env, name, r.output);
+	return lispora_finish(l, x, result);
+}
+
+int lispora_eval_file(lispora* l, const char* filename, char** result) {
+	lval* x = lval_import(l->env, (char*) filename);
+	return lispora_finish(l, x, result);
+}
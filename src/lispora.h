@@ -0,0 +1,98 @@
+#ifndef lispora_h
+#define lispora_h
+
+#include <stdio.h>
+
+/*
+** Interpreter Handle
+**
+** Every interpreter owns its grammar, global
+** environment and worker pool, so independent
+** interpreters can be used from different
+** threads at the same time. A single interpreter
+** must only be used from one thread at a time.
+*/
+
+typedef struct lispora lispora;
+
+lispora* lispora_create(void);
+
+/*
+** A fork shares the grammar, worker pool and
+** global environment of its base. Its own
+** definitions go to a separate top-level
+** environment that is thrown away on destroy,
+** so forks are cheap to make. Symbols the base
+** does not know are interned by the fork and
+** live until it is destroyed, so values the
+** fork made must not be used after that.
+** Forks of one base can be used from different
+** threads at the same time, their parallel
+** builtins share its workers. The base must not
+** be changed or destroyed while forks exist.
+*/
+lispora* lispora_fork(lispora* base);
+
+void lispora_destroy(lispora* l);
+
+/*
+** Where `print` and top-level errors go, stdout
+** by default. Output is buffered and flushed
+** when an eval returns or `flush` is called.
+*/
+void lispora_set_output(lispora* l, FILE* out);
+
+/* Workers used by the parallel builtins, 0 means one per online CPU */
+void lispora_set_threads(lispora* l, int threads);
+
+/*
+** Whether hot lambdas get compiled to machine
+** code, on by default where supported. Only
+** affects lambdas that are not compiled yet.
+*/
+void lispora_set_jit(lispora* l, int enabled);
+
+/*
+** Whether lambda bodies get compiled to trees
+** of closures when the lambda is created, on by
+** default. Otherwise they are evaluated by
+** walking the expression on every call.
+*/
+void lispora_set_closures(lispora* l, int enabled);
+
+/*
+** Whether quoted expressions from the reader
+** and lists built by `list` get hash-consed,
+** off by default. Equal ones then share a
+** single node and compare by pointer. Applies
+** to the interpreter and all of its forks.
+*/
+void lispora_set_hash_cons(lispora* l, int enabled);
+
+/*
+** Evaluation
+**
+** All return 1 on success and 0 if parsing or
+** evaluation failed. When `result` is not NULL
+** it receives a printed form of the value or of
+** the error, which the caller must free.
+**
+** `eval_string` evaluates the source as a single
+** expression like the REPL does. `eval_script`
+** and `eval_file` evaluate every top-level
+** expression in turn like `import` does, with
+** errors written to the output stream.
+** `eval_pipe` does the same for a stream that
+** can't seek, such as stdin, parsing the script
+** as it arrives.
+*/
+
+int lispora_eval_string(lispora* l, const char* name, const char* source, char** result);
+
+int lispora_eval_script(lispora* l, const char* name, const char* source, char** result);
+
+int lispora_eval_file(lispora* l, const char* filename, char** result);
+
+int lispora_eval_pipe(lispora* l, const char* name, FILE* pipe, char** result);
+
+#endif
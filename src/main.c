@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lispora.h"
+#include "server.h"
+
+#ifdef _WIN32
+
+static char buffer[2048];
+
+char* readline(char* prompt) {
+	fputs(prompt, stdout);
+	fgets(buffer, 2048, stdin);
+	char* cpy = malloc(strlen(buffer) + 1);
+	strcpy(cpy, buffer);
+	cpy[strlen(cpy) - 1] = '\0';
+	return cpy;
+}
+
+void add_history(char* unused) {};
+
+#else
+
+#include <editline/readline.h>
+
+#endif
+
+char* read_all_of(FILE* f, size_t* len) {
+	size_t cap = 4096;
+	char* buf = malloc(cap);
+
+	*len = 0;
+	size_t n;
+	while ((n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+		*len += n;
+		if (*len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+	}
+
+	return buf;
+}
+
+int run_client(const char* socket, int stats, int argc, char** argv) {
+	if (stats) {
+		return client_send(socket, REQUEST_STATS, "", 0);
+	}
+
+	// Without script arguments the script is read from stdin.
+	int status = 0;
+	for (int i = 0; i < (argc ? argc : 1); ++i) {
+		FILE* f = argc ? fopen(argv[i], "rb") : stdin;
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+
+		size_t len;
+		char* script = read_all_of(f, &len);
+		if (f != stdin) {
+			fclose(f);
+		}
+
+		status |= client_send(socket, REQUEST_EVAL, script, len);
+		free(script);
+	}
+
+	return status;
+}
+
+int main(int argc, char** argv) {
+	char* serve = NULL;
+	char* client = NULL;
+	int stats = 0;
+	int threads = 0;
+	int jit = 1;
+	int closures = 1;
+	int hash_cons = 0;
+
+	int first = 1;
+	while (first < argc && !strncmp(argv[first], "--", 2)) {
+		if (!strcmp(argv[first], "--threads") && first + 1 < argc) {
+			threads = atoi(argv[first + 1]);
+			first += 2;
+		} else if (!strcmp(argv[first], "--serve") && first + 1 < argc) {
+			serve = argv[first + 1];
+			first += 2;
+		} else if (!strcmp(argv[first], "--client") && first + 1 < argc) {
+			client = argv[first + 1];
+			first += 2;
+		} else if (!strcmp(argv[first], "--no-jit")) {
+			jit = 0;
+			first += 1;
+		} else if (!strcmp(argv[first], "--walk")) {
+			closures = 0;
+			first += 1;
+		} else if (!strcmp(argv[first], "--hash-cons")) {
+			hash_cons = 1;
+			first += 1;
+		} else if (!strcmp(argv[first], "--stats")) {
+			stats = 1;
+			first += 1;
+		} else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+			return 1;
+		}
+	}
+
+	if (client) {
+		return run_client(client, stats, argc - first, argv + first);
+	}
+
+	lispora* l = lispora_create();
+	lispora_set_threads(l, threads);
+	lispora_set_jit(l, jit);
+	lispora_set_closures(l, closures);
+	lispora_set_hash_cons(l, hash_cons);
+
+	if (first == argc && !serve) {
+		puts("Lispora version 0.1.0.0.0");
+		puts("Press Ctrl-C for exit.");
+
+		while (1) {
+			char* input = readline("lispora> ");
+			add_history(input);
+
+			char* output;
+			lispora_eval_string(l, "<stdin>", input, &output);
+			puts(output);
+
+			free(output);
+			free(input);
+		}
+	}
+
+	// A script argument of '-' is read from stdin as it arrives.
+	for (int i = first; i < argc; ++i) {
+		char* output;
+		int ok = strcmp(argv[i], "-")
+			? lispora_eval_file(l, argv[i], &output)
+			: lispora_eval_pipe(l, "<stdin>", stdin, &output);
+		if (!ok) {
+			puts(output);
+		}
+		free(output);
+	}
+
+	// The files given to a server only warm up its base interpreter.
+	int status = serve ? server_run(l, serve) : 0;
+
+	lispora_destroy(l);
+
+	return status;
+}
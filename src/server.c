@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+/* Largest payload the length field of a frame can hold */
+#define FRAME_MAX UINT32_MAX
+
+/* Request latencies in power of two microsecond buckets */
+#define LATENCY_BUCKETS 32
+
+typedef struct {
+	long requests;
+	long errors;
+	long latency[LATENCY_BUCKETS];
+} stats;
+
+int write_all(int fd, const char* buf, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0) {
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int read_all(int fd, char* buf, size_t len) {
+	while (len) {
+		ssize_t n = read(fd, buf, len);
+		if (n <= 0) {
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int write_frame(int fd, char type, const char* payload, size_t len) {
+	if (len > FRAME_MAX) {
+		return 0;
+	}
+
+	unsigned char header[5] = {
+		type, len >> 24, len >> 16, len >> 8, len
+	};
+	return write_all(fd, (char*) header, 5) && write_all(fd, payload, len);
+}
+
+// Returns the payload, NUL terminated, or NULL once the peer is gone.
+char* read_frame(int fd, char* type, uint32_t* len) {
+	unsigned char header[5];
+	if (!read_all(fd, (char*) header, 5)) {
+		return NULL;
+	}
+
+	*type = header[0];
+	*len = (uint32_t) header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+
+	char* payload = malloc((size_t) *len + 1);
+	if (!payload || !read_all(fd, payload, *len)) {
+		free(payload);
+		return NULL;
+	}
+	payload[*len] = '\0';
+
+	return payload;
+}
+
+int connect_to(const char* path, int listening) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (listening) {
+		unlink(path);
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+	} else if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+double elapsed_us(struct timespec* start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e6 + (end.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+void stats_record(stats* s, double us, int ok) {
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && us >= (double) (1L << bucket)) {
+		bucket++;
+	}
+
+	s->requests++;
+	s->errors += !ok;
+	s->latency[bucket]++;
+}
+
+char* stats_report(stats* s, size_t* len) {
+	char* report;
+	FILE* f = open_memstream(&report, len);
+
+	fprintf(f, "requests %li\nerrors %li\n", s->requests, s->errors);
+	for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+		if (s->latency[i]) {
+			fprintf(f, "< %lius %li\n", 1L << i, s->latency[i]);
+		}
+	}
+
+	fclose(f);
+	return report;
+}
+
+int handle_eval(lispora* base, const char* script, int fd, stats* s) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	char* output;
+	size_t len;
+	FILE* out = open_memstream(&output, &len);
+
+	lispora* l = lispora_fork(base);
+	lispora_set_output(l, out);
+
+	char* result;
+	int ok = lispora_eval_script(l, "<request>", script, &result);
+	if (!ok) {
+		fprintf(out, "%s\n", result);
+	}
+	free(result);
+
+	lispora_destroy(l);
+	fclose(out);
+
+	stats_record(s, elapsed_us(&start), ok);
+
+	if (len > FRAME_MAX) {
+		free(output);
+		char* msg = "Output is too large for a response";
+		return write_frame(fd, RESPONSE_ERROR, msg, strlen(msg));
+	}
+
+	int sent = write_frame(fd, ok ? RESPONSE_OK : RESPONSE_ERROR, output, len);
+	free(output);
+	return sent;
+}
+
+int server_run(lispora* base, const char* path) {
+	int listener = connect_to(path, 1);
+	if (listener < 0) {
+		return 1;
+	}
+
+	// A client hanging up early must not take the server down with it.
+	signal(SIGPIPE, SIG_IGN);
+
+	stats s;
+	memset(&s, 0, sizeof(s));
+
+	while (1) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+
+		char type;
+		uint32_t len;
+		char* payload;
+		int alive = 1;
+
+		while (alive && (payload = read_frame(fd, &type, &len))) {
+			if (type == REQUEST_EVAL) {
+				alive = handle_eval(base, payload, fd, &s);
+			} else if (type == REQUEST_STATS) {
+				size_t report_len;
+				char* report = stats_report(&s, &report_len);
+				alive = write_frame(fd, RESPONSE_OK, report, report_len);
+				free(report);
+			} else {
+				char* msg = "Unknown request type";
+				alive = write_frame(fd, RESPONSE_ERROR, msg, strlen(msg));
+			}
+			free(payload);
+		}
+
+		close(fd);
+	}
+
+	return 0;
+}
+
+int client_send(const char* path, char type, const char* payload, size_t len) {
+	if (len > FRAME_MAX) {
+		fprintf(stderr, "Request of %zu bytes is too large to send\n", len);
+		return 1;
+	}
+
+	int fd = connect_to(path, 0);
+	if (fd < 0) {
+		return 1;
+	}
+
+	char status;
+	uint32_t out_len;
+	char* output = NULL;
+
+	if (write_frame(fd, type, payload, len)) {
+		output = read_frame(fd, &status, &out_len);
+	}
+	close(fd);
+
+	if (!output) {
+		fprintf(stderr, "No response from '%s'\n", path);
+		return 1;
+	}
+
+	fwrite(output, 1, out_len, stdout);
+	free(output);
+
+	return status == RESPONSE_OK ? 0 : 1;
+}
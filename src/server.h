@@ -0,0 +1,36 @@
+#ifndef server_h
+#define server_h
+
+#include "lispora.h"
+
+/*
+** Evaluation Server
+**
+** Requests and responses are framed the same
+** way: a single type or status byte followed by
+** a 4 byte big-endian payload length and the
+** payload itself.
+**
+** An eval request carries a script, which is run
+** in a fresh fork of the warm base interpreter.
+** The response carries everything the script
+** printed. A stats request has no payload and is
+** answered with a latency histogram of the eval
+** requests handled so far.
+*/
+
+enum {
+	REQUEST_EVAL  = 'E',
+	REQUEST_STATS = 'S'
+};
+
+enum {
+	RESPONSE_OK    = 0,
+	RESPONSE_ERROR = 1
+};
+
+int server_run(lispora* base, const char* path);
+
+int client_send(const char* path, char type, const char* payload, size_t len);
+
+#endif